@@ -0,0 +1,1321 @@
+/*-
+ * Copyright (c) 2024 John Baldwin <jhb@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <sys/event.h>
+#include <sys/filio.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libutil.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echodev.h>
+
+#include "echoctl.h"
+
+#define	BENCH_MAXLIST	16
+#define	BENCH_MAXTHREADS	256
+
+/* The IPC mechanism carrying the data. */
+enum bench_transport {
+	XPORT_ECHO,
+	XPORT_PIPE,
+	XPORT_SOCKETPAIR,
+	XPORT_FIFO,
+};
+
+static const char *bench_transport_names[] = {
+	[XPORT_ECHO] = "echo",
+	[XPORT_PIPE] = "pipe",
+	[XPORT_SOCKETPAIR] = "socketpair",
+	[XPORT_FIFO] = "fifo",
+};
+
+/* How a thread waits when an I/O request would block. */
+enum bench_wait {
+	WAIT_BLOCK,
+	WAIT_POLL,
+	WAIT_KQUEUE,
+};
+
+static const char *bench_wait_names[] = {
+	[WAIT_BLOCK] = "block",
+	[WAIT_POLL] = "poll",
+	[WAIT_KQUEUE] = "kqueue",
+};
+
+enum bench_affinity {
+	AFFINITY_NONE,
+	AFFINITY_SPREAD,
+};
+
+static const char *bench_affinity_names[] = {
+	[AFFINITY_NONE] = "none",
+	[AFFINITY_SPREAD] = "spread",
+};
+
+/* A descriptor along with the state needed to wait on it. */
+struct bench_io {
+	int	fd;
+	int	kq;
+	enum bench_wait wait;
+	bool	write;
+};
+
+struct bench_config {
+	enum bench_transport transport;
+	int	writers;
+	int	readers;
+	size_t	block;
+	size_t	bufsize;
+	enum bench_wait wait;
+	enum bench_affinity affinity;
+	double	secs;
+};
+
+struct bench_run {
+	enum bench_wait wait;
+	size_t	block;
+	atomic_bool stop;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct bench_run *run;
+	int	fd;
+	int	cpu;
+	uint64_t bytes;
+	uint64_t ops;
+};
+
+static cpuset_t bench_cpus;
+
+static void
+bench_io_init(struct bench_io *io, int fd, enum bench_wait wait, bool write)
+{
+	struct kevent kev;
+
+	io->fd = fd;
+	io->wait = wait;
+	io->write = write;
+	io->kq = -1;
+	if (wait == WAIT_BLOCK)
+		return;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		err(1, "fcntl(O_NONBLOCK)");
+	if (wait != WAIT_KQUEUE)
+		return;
+	io->kq = kqueue();
+	if (io->kq == -1)
+		err(1, "kqueue");
+	EV_SET(&kev, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD, 0, 0,
+	    NULL);
+	if (kevent(io->kq, &kev, 1, NULL, 0, NULL) == -1)
+		err(1, "kevent");
+}
+
+static void
+bench_io_close(struct bench_io *io)
+{
+	if (io->kq != -1)
+		close(io->kq);
+	close(io->fd);
+}
+
+/* Wait for a non-blocking descriptor to become ready. */
+static void
+bench_io_wait(struct bench_io *io)
+{
+	struct pollfd pfd;
+	struct kevent kev;
+
+	switch (io->wait) {
+	case WAIT_POLL:
+		pfd.fd = io->fd;
+		pfd.events = io->write ? POLLOUT : POLLIN;
+		if (poll(&pfd, 1, INFTIM) == -1 && errno != EINTR)
+			err(1, "poll");
+		break;
+	case WAIT_KQUEUE:
+		if (kevent(io->kq, NULL, 0, &kev, 1, NULL) == -1 &&
+		    errno != EINTR)
+			err(1, "kevent");
+		break;
+	default:
+		break;
+	}
+}
+
+/* Returns the number of bytes read, or 0 at EOF. */
+static ssize_t
+bench_read(struct bench_io *io, void *buf, size_t len)
+{
+	ssize_t n;
+
+	for (;;) {
+		n = read(io->fd, buf, len);
+		if (n != -1)
+			return (n);
+		if (errno == EAGAIN)
+			bench_io_wait(io);
+		else if (errno != EINTR)
+			err(1, "read");
+	}
+}
+
+/* Read exactly len bytes.  Returns false at EOF. */
+static bool
+bench_read_full(struct bench_io *io, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = bench_read(io, p, len);
+		if (n == 0)
+			return (false);
+		p += n;
+		len -= n;
+	}
+	return (true);
+}
+
+static void
+bench_write(struct bench_io *io, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(io->fd, p, len);
+		if (n == -1) {
+			if (errno == EAGAIN)
+				bench_io_wait(io);
+			else if (errno != EINTR)
+				err(1, "write");
+			continue;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+static void
+bench_cpus_init(void)
+{
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(bench_cpus), &bench_cpus) != 0)
+		err(1, "cpuset_getaffinity");
+}
+
+/* Pin the current thread to the n'th CPU available to the process. */
+static void
+bench_pin(int n)
+{
+	cpuset_t mask;
+	int cpu;
+
+	n %= CPU_COUNT(&bench_cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &bench_cpus))
+			continue;
+		if (n-- == 0)
+			break;
+	}
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+	    sizeof(mask), &mask) != 0)
+		err(1, "cpuset_setaffinity");
+}
+
+static double
+timespec_diff(const struct timespec *start, const struct timespec *end)
+{
+	return ((end->tv_sec - start->tv_sec) +
+	    (end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/* Returns the user and system time used in seconds. */
+static double
+rusage_secs(const struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+	    ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6);
+}
+
+/*
+ * HDR-style latency histogram.  Values below 2 * HDR_SUB nanoseconds
+ * are counted exactly; larger values are split into HDR_SUB buckets
+ * per power of two, for a relative error of about 3%.
+ */
+#define	HDR_SUB_BITS	5
+#define	HDR_SUB		(1 << HDR_SUB_BITS)
+#define	HDR_BUCKETS	((64 - HDR_SUB_BITS) * HDR_SUB)
+
+struct hdr_hist {
+	uint64_t counts[HDR_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static void
+hdr_init(struct hdr_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static void
+hdr_add(struct hdr_hist *h, uint64_t ns)
+{
+	int e;
+
+	if (ns < 2 * HDR_SUB)
+		h->counts[ns]++;
+	else {
+		e = flsll(ns) - (HDR_SUB_BITS + 1);
+		h->counts[(e + 1) * HDR_SUB + (ns >> e) - HDR_SUB]++;
+	}
+	h->total++;
+	if (ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+/* Returns the largest value counted in a bucket. */
+static uint64_t
+hdr_bucket_max(int b)
+{
+	int e;
+
+	if (b < 2 * HDR_SUB)
+		return (b);
+	e = b / HDR_SUB - 1;
+	return ((((uint64_t)(b % HDR_SUB + HDR_SUB) + 1) << e) - 1);
+}
+
+static uint64_t
+hdr_percentile(const struct hdr_hist *h, double pct)
+{
+	uint64_t sum, target;
+	int b;
+
+	target = (uint64_t)(h->total * pct / 100);
+	if (target == 0)
+		target = 1;
+	sum = 0;
+	for (b = 0; b < HDR_BUCKETS; b++) {
+		sum += h->counts[b];
+		if (sum >= target)
+			return (MIN(hdr_bucket_max(b), h->max));
+	}
+	return (h->max);
+}
+
+static uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (timespec_ns(&ts));
+}
+
+static void *
+bench_writer(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct bench_run *run = bt->run;
+	struct bench_io io;
+	char *buf;
+
+	if (bt->cpu != -1)
+		bench_pin(bt->cpu);
+	bench_io_init(&io, bt->fd, run->wait, true);
+	if (posix_memalign((void **)&buf, getpagesize(), run->block) != 0)
+		errx(1, "out of memory");
+	memset(buf, 0xa5, run->block);
+	while (!atomic_load(&run->stop)) {
+		bench_write(&io, buf, run->block);
+		bt->bytes += run->block;
+		bt->ops++;
+	}
+	free(buf);
+
+	/* Readers see EOF once every writer has closed. */
+	bench_io_close(&io);
+	return (NULL);
+}
+
+static void *
+bench_reader(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct bench_run *run = bt->run;
+	struct bench_io io;
+	char *buf;
+	ssize_t n;
+
+	if (bt->cpu != -1)
+		bench_pin(bt->cpu);
+	bench_io_init(&io, bt->fd, run->wait, false);
+	if (posix_memalign((void **)&buf, getpagesize(), run->block) != 0)
+		errx(1, "out of memory");
+	while ((n = bench_read(&io, buf, run->block)) > 0) {
+		bt->bytes += n;
+		bt->ops++;
+	}
+	free(buf);
+	bench_io_close(&io);
+	return (NULL);
+}
+
+static void
+bench_start(struct bench_thread *bt, struct bench_run *run, int fd, int cpu,
+    void *(*fn)(void *))
+{
+	int error;
+
+	bt->run = run;
+	bt->cpu = cpu;
+	bt->bytes = 0;
+	bt->ops = 0;
+	bt->fd = dup(fd);
+	if (bt->fd == -1)
+		err(1, "dup");
+	error = pthread_create(&bt->thread, NULL, fn, bt);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+}
+
+static size_t
+bench_getsize(void)
+{
+	size_t len;
+	int fd;
+
+	fd = open_device(O_RDONLY);
+	if (ioctl(fd, ECHODEV_GBUFSIZE, &len) == -1)
+		err(1, "ioctl(ECHODEV_GBUFSIZE)");
+	close(fd);
+	return (len);
+}
+
+static void
+bench_setsize(size_t len)
+{
+	int fd;
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_SBUFSIZE, &len) == -1)
+		err(1, "ioctl(ECHODEV_SBUFSIZE)");
+	if (ioctl(fd, ECHODEV_CLEAR) == -1)
+		err(1, "ioctl(ECHODEV_CLEAR)");
+	close(fd);
+}
+
+/* Open a FIFO in a temporary directory that is removed at once. */
+static void
+bench_fifo(int fds[2])
+{
+	char dir[] = "/tmp/echoctl.XXXXXX";
+	char path[sizeof(dir) + 5];
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/fifo", dir);
+	if (mkfifo(path, 0600) == -1)
+		err(1, "mkfifo");
+
+	/* Opening the read side first avoids blocking. */
+	fds[0] = open(path, O_RDONLY | O_NONBLOCK);
+	if (fds[0] == -1)
+		err(1, "%s", path);
+	fds[1] = open(path, O_WRONLY);
+	if (fds[1] == -1)
+		err(1, "%s", path);
+	if (fcntl(fds[0], F_SETFL, 0) == -1)
+		err(1, "fcntl");
+	unlink(path);
+	rmdir(dir);
+}
+
+/*
+ * Open a one-way channel over the given transport.  fds[0] is the
+ * read side and fds[1] the write side.  A non-zero bufsize sets the
+ * buffer size where the transport permits it.  Returns the capacity
+ * of the channel, or 0 if it is not known.
+ */
+static size_t
+bench_channel(enum bench_transport transport, size_t bufsize, int fds[2])
+{
+	int space, val;
+
+	switch (transport) {
+	case XPORT_ECHO:
+		if (bufsize != 0)
+			bench_setsize(bufsize);
+		fds[0] = open_device(O_RDONLY);
+		fds[1] = open_device(O_WRONLY);
+		if (ioctl(fds[0], ECHODEV_GBUFSIZE, &bufsize) == -1)
+			err(1, "ioctl(ECHODEV_GBUFSIZE)");
+		return (bufsize);
+	case XPORT_PIPE:
+		if (pipe(fds) == -1)
+			err(1, "pipe");
+		break;
+	case XPORT_SOCKETPAIR:
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+			err(1, "socketpair");
+		if (bufsize != 0) {
+			val = bufsize > INT_MAX ? INT_MAX : (int)bufsize;
+			if (setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &val,
+			    sizeof(val)) == -1 ||
+			    setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &val,
+			    sizeof(val)) == -1)
+				err(1, "setsockopt");
+		}
+		break;
+	case XPORT_FIFO:
+		bench_fifo(fds);
+		break;
+	}
+
+	/* Pipes, FIFOs and sockets report free space in an empty buffer. */
+	if (ioctl(fds[1], FIONSPACE, &space) == -1)
+		return (0);
+	return (space);
+}
+
+/*
+ * Run one configuration for the requested time and print a line of
+ * results.  Writers stop at the deadline and the run ends when the
+ * readers have drained the buffer.
+ */
+static void
+bench_one(const struct bench_config *bc)
+{
+	struct bench_thread *wt, *rt;
+	struct bench_run run;
+	struct timespec start, end, ts;
+	struct rusage ru_start, ru_end;
+	uint64_t rbytes, rops, wops;
+	double cpu, elapsed;
+	size_t capacity;
+	int fds[2], i;
+
+	run.wait = bc->wait;
+	run.block = bc->block;
+	atomic_init(&run.stop, false);
+	wt = calloc(bc->writers, sizeof(*wt));
+	rt = calloc(bc->readers, sizeof(*rt));
+	if (wt == NULL || rt == NULL)
+		errx(1, "out of memory");
+
+	capacity = bench_channel(bc->transport, bc->bufsize, fds);
+	getrusage(RUSAGE_SELF, &ru_start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < bc->readers; i++)
+		bench_start(&rt[i], &run, fds[0],
+		    bc->affinity == AFFINITY_SPREAD ? bc->writers + i : -1,
+		    bench_reader);
+	for (i = 0; i < bc->writers; i++)
+		bench_start(&wt[i], &run, fds[1],
+		    bc->affinity == AFFINITY_SPREAD ? i : -1, bench_writer);
+	close(fds[0]);
+	close(fds[1]);
+
+	ts.tv_sec = (time_t)bc->secs;
+	ts.tv_nsec = (long)((bc->secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	atomic_store(&run.stop, true);
+
+	wops = 0;
+	for (i = 0; i < bc->writers; i++) {
+		pthread_join(wt[i].thread, NULL);
+		wops += wt[i].ops;
+	}
+	rbytes = 0;
+	rops = 0;
+	for (i = 0; i < bc->readers; i++) {
+		pthread_join(rt[i].thread, NULL);
+		rbytes += rt[i].bytes;
+		rops += rt[i].ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &ru_end);
+	free(rt);
+	free(wt);
+
+	elapsed = timespec_diff(&start, &end);
+	cpu = rusage_secs(&ru_end) - rusage_secs(&ru_start);
+	printf("%s,%d,%d,%zu,%zu,%s,%s,%.3f,%ju,%.1f,%.0f,%.0f,%.3f\n",
+	    bench_transport_names[bc->transport], bc->writers, bc->readers,
+	    bc->block, capacity, bench_wait_names[bc->wait],
+	    bench_affinity_names[bc->affinity], elapsed, (uintmax_t)rbytes,
+	    rbytes / elapsed / (1024 * 1024), wops / elapsed, rops / elapsed,
+	    rbytes == 0 ? 0 : cpu * 1e9 / rbytes);
+	fflush(stdout);
+}
+
+/* Parse a comma-separated list of sizes such as "4k,64k". */
+static int
+bench_parse_sizes(const char *arg, size_t *vals, uint64_t min, uint64_t max,
+    const char *what)
+{
+	char *list, *p, *s;
+	uint64_t val;
+	int count;
+
+	list = strdup(arg);
+	if (list == NULL)
+		errx(1, "out of memory");
+	count = 0;
+	p = list;
+	while ((s = strsep(&p, ",")) != NULL) {
+		if (count == BENCH_MAXLIST)
+			errx(1, "too many %s", what);
+		if (expand_number(s, &val) != 0)
+			err(1, "invalid %s %s", what, s);
+		if (val < min || val > max)
+			errx(1, "%s %s out of range", what, s);
+		vals[count++] = val;
+	}
+	free(list);
+	return (count);
+}
+
+/* Parse a comma-separated list of names into indices. */
+static int
+bench_parse_names(const char *arg, const char **names, int nnames,
+    int *vals, const char *what)
+{
+	char *list, *p, *s;
+	int count, i;
+
+	list = strdup(arg);
+	if (list == NULL)
+		errx(1, "out of memory");
+	count = 0;
+	p = list;
+	while ((s = strsep(&p, ",")) != NULL) {
+		if (count == BENCH_MAXLIST)
+			errx(1, "too many %s", what);
+		for (i = 0; i < nnames; i++)
+			if (strcmp(s, names[i]) == 0)
+				break;
+		if (i == nnames)
+			errx(1, "invalid %s %s", what, s);
+		vals[count++] = i;
+	}
+	free(list);
+	return (count);
+}
+
+/*
+ * Measure throughput across every combination of transport, writer
+ * and reader counts, transfer sizes, buffer sizes, wait modes, and CPU
+ * affinity.  Results are printed as CSV with one line per combination.
+ * The bufsize column is the capacity actually in effect, as pipes and
+ * FIFOs cannot be resized.
+ */
+void
+bench(int argc, char **argv)
+{
+	size_t blocks[BENCH_MAXLIST], bufsizes[BENCH_MAXLIST];
+	size_t readers[BENCH_MAXLIST], writers[BENCH_MAXLIST];
+	int affinities[BENCH_MAXLIST], transports[BENCH_MAXLIST];
+	int waits[BENCH_MAXLIST];
+	int naffinities, nblocks, nbufsizes, nreaders, ntransports, nwaits;
+	int nwriters;
+	struct bench_config bc;
+	int a, b, ch, i, m, n, r, s, t, total, w;
+	size_t saved;
+	bool echo;
+	char *cp;
+
+	argc--;
+	argv++;
+
+	blocks[0] = 4096;
+	blocks[1] = 65536;
+	nblocks = 2;
+	bufsizes[0] = 65536;
+	bufsizes[1] = 1024 * 1024;
+	nbufsizes = 2;
+	waits[0] = WAIT_BLOCK;
+	waits[1] = WAIT_POLL;
+	waits[2] = WAIT_KQUEUE;
+	nwaits = 3;
+	affinities[0] = AFFINITY_NONE;
+	naffinities = 1;
+	readers[0] = 1;
+	nreaders = 1;
+	writers[0] = 1;
+	nwriters = 1;
+	transports[0] = XPORT_ECHO;
+	ntransports = 1;
+	bc.secs = 1;
+	while ((ch = getopt(argc, argv, "b:B:c:m:r:t:T:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nblocks = bench_parse_sizes(optarg, blocks, 1,
+			    SSIZE_MAX, "transfer size");
+			break;
+		case 'B':
+			nbufsizes = bench_parse_sizes(optarg, bufsizes, 1,
+			    SSIZE_MAX, "buffer size");
+			break;
+		case 'c':
+			naffinities = bench_parse_names(optarg,
+			    bench_affinity_names, nitems(bench_affinity_names),
+			    affinities, "affinity");
+			break;
+		case 'm':
+			nwaits = bench_parse_names(optarg, bench_wait_names,
+			    nitems(bench_wait_names), waits, "mode");
+			break;
+		case 'r':
+			nreaders = bench_parse_sizes(optarg, readers, 1,
+			    BENCH_MAXTHREADS, "reader count");
+			break;
+		case 't':
+			bc.secs = strtod(optarg, &cp);
+			if (*cp != '\0' || bc.secs <= 0)
+				errx(1, "invalid time %s", optarg);
+			break;
+		case 'T':
+			ntransports = bench_parse_names(optarg,
+			    bench_transport_names,
+			    nitems(bench_transport_names), transports,
+			    "transport");
+			break;
+		case 'w':
+			nwriters = bench_parse_sizes(optarg, writers, 1,
+			    BENCH_MAXTHREADS, "writer count");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	bench_cpus_init();
+
+	echo = false;
+	for (i = 0; i < ntransports; i++)
+		if (transports[i] == XPORT_ECHO)
+			echo = true;
+	if (echo)
+		saved = bench_getsize();
+
+	/*
+	 * Transports vary fastest so that each configuration is
+	 * measured over every transport on adjacent lines.
+	 */
+	printf("transport,writers,readers,size,bufsize,mode,affinity,seconds,"
+	    "bytes,mb_per_sec,writes_per_sec,reads_per_sec,"
+	    "cpu_ns_per_byte\n");
+	total = nwriters * nreaders * nblocks * nbufsizes * nwaits *
+	    naffinities * ntransports;
+	for (i = 0; i < total; i++) {
+		n = i;
+		t = n % ntransports;
+		n /= ntransports;
+		a = n % naffinities;
+		n /= naffinities;
+		m = n % nwaits;
+		n /= nwaits;
+		s = n % nbufsizes;
+		n /= nbufsizes;
+		b = n % nblocks;
+		n /= nblocks;
+		r = n % nreaders;
+		w = n / nreaders;
+		bc.transport = transports[t];
+		bc.writers = writers[w];
+		bc.readers = readers[r];
+		bc.block = blocks[b];
+		bc.bufsize = bufsizes[s];
+		bc.wait = waits[m];
+		bc.affinity = affinities[a];
+		bench_one(&bc);
+	}
+
+	if (echo)
+		bench_setsize(saved);
+}
+
+/* One side of a ping-pong exchange. */
+struct pingpong_side {
+	pthread_t thread;
+	struct bench_io rio;
+	struct bench_io wio;
+	struct hdr_hist *hist;		/* NULL for the echoing side */
+	size_t	size;
+	int	count;
+	int	warmup;
+	int	cpu;
+};
+
+static void *
+pingpong_thread(void *arg)
+{
+	struct pingpong_side *ps = arg;
+	uint64_t start;
+	char *buf;
+	int i;
+
+	if (ps->cpu != -1)
+		bench_pin(ps->cpu);
+	buf = malloc(ps->size);
+	if (buf == NULL)
+		errx(1, "out of memory");
+	memset(buf, 0x5a, ps->size);
+	if (ps->hist == NULL) {
+		while (bench_read_full(&ps->rio, buf, ps->size))
+			bench_write(&ps->wio, buf, ps->size);
+	} else {
+		for (i = 0; i < ps->warmup + ps->count; i++) {
+			start = now_ns();
+			bench_write(&ps->wio, buf, ps->size);
+			if (!bench_read_full(&ps->rio, buf, ps->size))
+				errx(1, "unexpected EOF");
+			if (i >= ps->warmup)
+				hdr_add(ps->hist, now_ns() - start);
+		}
+	}
+	free(buf);
+
+	/* Closing the initiator's write side ends the echoing side. */
+	bench_io_close(&ps->wio);
+	bench_io_close(&ps->rio);
+	return (NULL);
+}
+
+/*
+ * Open the descriptors for both sides.  Other transports use one
+ * channel in each direction.  For echo with a second device, side 0
+ * writes to the first instance and reads from the second.  Otherwise
+ * both sides are endpoints of a pair on the first instance.
+ */
+static void
+pingpong_open(enum bench_transport transport, const char *other,
+    int fds[2][2])
+{
+	const char *saved;
+	int ch[2], side;
+
+	if (transport != XPORT_ECHO) {
+		bench_channel(transport, 0, ch);
+		fds[0][1] = ch[1];
+		fds[1][0] = ch[0];
+		bench_channel(transport, 0, ch);
+		fds[1][1] = ch[1];
+		fds[0][0] = ch[0];
+		return;
+	}
+	if (other != NULL) {
+		fds[0][1] = open_device(O_WRONLY);
+		fds[1][0] = open_device(O_RDONLY);
+		saved = device;
+		device = other;
+		fds[0][0] = open_device(O_RDONLY);
+		fds[1][1] = open_device(O_WRONLY);
+		device = saved;
+		return;
+	}
+	for (side = 0; side < 2; side++) {
+		fds[side][0] = open_device(O_RDWR);
+		if (ioctl(fds[side][0], ECHODEV_PAIR, &side) == -1)
+			err(1, "ioctl(ECHODEV_PAIR)");
+		fds[side][1] = dup(fds[side][0]);
+		if (fds[side][1] == -1)
+			err(1, "dup");
+	}
+}
+
+static void
+pingpong_run(enum bench_transport transport, const char *other,
+    enum bench_wait wait, enum bench_affinity affinity, size_t size,
+    int count, int warmup)
+{
+	struct pingpong_side ps[2];
+	struct hdr_hist *h;
+	int error, fds[2][2], i;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL)
+		errx(1, "out of memory");
+	hdr_init(h);
+	pingpong_open(transport, other, fds);
+	for (i = 0; i < 2; i++) {
+		bench_io_init(&ps[i].rio, fds[i][0], wait, false);
+		bench_io_init(&ps[i].wio, fds[i][1], wait, true);
+		ps[i].hist = i == 0 ? h : NULL;
+		ps[i].size = size;
+		ps[i].count = count;
+		ps[i].warmup = warmup;
+		ps[i].cpu = affinity == AFFINITY_SPREAD ? i : -1;
+	}
+	for (i = 1; i >= 0; i--) {
+		error = pthread_create(&ps[i].thread, NULL, pingpong_thread,
+		    &ps[i]);
+		if (error != 0)
+			errc(1, error, "pthread_create");
+	}
+	for (i = 0; i < 2; i++)
+		pthread_join(ps[i].thread, NULL);
+
+	printf("%-10s %-8s %10zu %10ju %10ju %10ju %10ju %10ju\n",
+	    bench_transport_names[transport], bench_wait_names[wait], size,
+	    (uintmax_t)h->min,
+	    (uintmax_t)hdr_percentile(h, 50), (uintmax_t)hdr_percentile(h, 99),
+	    (uintmax_t)hdr_percentile(h, 99.9), (uintmax_t)h->max);
+	fflush(stdout);
+	free(h);
+}
+
+/*
+ * Measure round-trip times of messages bounced between two threads
+ * through a pair, a pair of instances, or another transport.  Times
+ * are reported in nanoseconds.
+ */
+void
+pingpong(int argc, char **argv)
+{
+	size_t sizes[BENCH_MAXLIST];
+	int transports[BENCH_MAXLIST], waits[BENCH_MAXLIST];
+	const char *errstr, *other;
+	enum bench_affinity affinity;
+	int ch, count, i, j, k, nsizes, ntransports, nwaits, warmup;
+
+	argc--;
+	argv++;
+
+	affinity = AFFINITY_SPREAD;
+	count = 100000;
+	other = NULL;
+	sizes[0] = 64;
+	nsizes = 1;
+	waits[0] = WAIT_BLOCK;
+	waits[1] = WAIT_POLL;
+	waits[2] = WAIT_KQUEUE;
+	nwaits = 3;
+	transports[0] = XPORT_ECHO;
+	ntransports = 1;
+	warmup = 1000;
+	while ((ch = getopt(argc, argv, "D:m:n:s:T:uW:")) != -1) {
+		switch (ch) {
+		case 'D':
+			other = optarg;
+			break;
+		case 'm':
+			nwaits = bench_parse_names(optarg, bench_wait_names,
+			    nitems(bench_wait_names), waits, "mode");
+			break;
+		case 'n':
+			count = (int)strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count is %s", errstr);
+			break;
+		case 's':
+			nsizes = bench_parse_sizes(optarg, sizes, 1, SSIZE_MAX,
+			    "message size");
+			break;
+		case 'T':
+			ntransports = bench_parse_names(optarg,
+			    bench_transport_names,
+			    nitems(bench_transport_names), transports,
+			    "transport");
+			break;
+		case 'u':
+			affinity = AFFINITY_NONE;
+			break;
+		case 'W':
+			warmup = (int)strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "warmup count is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	bench_cpus_init();
+	printf("%-10s %-8s %10s %10s %10s %10s %10s %10s\n", "transport",
+	    "mode", "size", "min", "p50", "p99", "p99.9", "max");
+	for (i = 0; i < nsizes; i++)
+		for (j = 0; j < nwaits; j++)
+			for (k = 0; k < ntransports; k++)
+				pingpong_run(transports[k], other, waits[j],
+				    affinity, sizes[i], count, warmup);
+}
+
+/* Distribution of message sizes for the load generator. */
+struct load_dist {
+	enum { DIST_FIXED, DIST_UNIFORM, DIST_EXP } kind;
+	size_t	min;
+	size_t	max;
+	double	mean;
+};
+
+/* Each message starts with its intended send time and total length. */
+struct load_hdr {
+	uint64_t lh_intended;
+	uint64_t lh_len;
+};
+
+struct load_run {
+	struct bench_io rio;
+	struct bench_io wio;
+	const struct load_dist *dist;
+	double	rate;
+	int	burst;
+	uint64_t start;
+	uint64_t end;
+	uint64_t finish;		/* when the last message was sent */
+	uint64_t sent;
+	uint64_t lag;			/* largest delay past intended time */
+	struct hdr_hist hist;
+};
+
+static size_t
+load_size(const struct load_dist *ld)
+{
+	double u;
+
+	switch (ld->kind) {
+	case DIST_UNIFORM:
+		return (ld->min + arc4random_uniform(ld->max - ld->min + 1));
+	case DIST_EXP:
+		u = arc4random() / 4294967296.0;
+		return (MIN(MAX((size_t)(-ld->mean * log(1 - u)), ld->min),
+		    ld->max));
+	default:
+		return (ld->min);
+	}
+}
+
+/*
+ * Send messages on a fixed schedule.  Each burst has an intended send
+ * time, and a producer that falls behind sends immediately without
+ * moving the schedule, so delays inside write(2) are charged to the
+ * messages that were held up.
+ */
+static void *
+load_producer(void *arg)
+{
+	struct load_run *lr = arg;
+	struct load_hdr *lh;
+	struct timespec ts;
+	uint64_t intended, now, period, i;
+	size_t len;
+
+	lh = malloc(lr->dist->max);
+	if (lh == NULL)
+		errx(1, "out of memory");
+	memset(lh, 0xa5, lr->dist->max);
+	period = (uint64_t)(lr->burst * 1e9 / lr->rate);
+	for (i = 0;; i++) {
+		intended = lr->start + i / lr->burst * period;
+		if (intended >= lr->end)
+			break;
+		now = now_ns();
+		if (now < intended) {
+			ts.tv_sec = intended / 1000000000;
+			ts.tv_nsec = intended % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			    &ts, NULL) == EINTR)
+				;
+		} else if (now - intended > lr->lag)
+			lr->lag = now - intended;
+		len = load_size(lr->dist);
+		lh->lh_intended = intended;
+		lh->lh_len = len;
+		bench_write(&lr->wio, lh, len);
+	}
+	lr->finish = now_ns();
+	lr->sent = i;
+	free(lh);
+	bench_io_close(&lr->wio);
+	return (NULL);
+}
+
+/* Record the latency of each message from its intended send time. */
+static void *
+load_consumer(void *arg)
+{
+	struct load_run *lr = arg;
+	struct load_hdr *lh;
+
+	lh = malloc(lr->dist->max);
+	if (lh == NULL)
+		errx(1, "out of memory");
+	while (bench_read_full(&lr->rio, lh, sizeof(*lh))) {
+		if (lh->lh_len < sizeof(*lh) || lh->lh_len > lr->dist->max)
+			errx(1, "corrupt message length %ju",
+			    (uintmax_t)lh->lh_len);
+		if (!bench_read_full(&lr->rio, lh + 1,
+		    lh->lh_len - sizeof(*lh)))
+			errx(1, "truncated message");
+		hdr_add(&lr->hist, now_ns() - lh->lh_intended);
+	}
+	free(lh);
+	bench_io_close(&lr->rio);
+	return (NULL);
+}
+
+static void
+load_run(enum bench_transport transport, size_t bufsize,
+    enum bench_wait wait, const struct load_dist *dist, double rate,
+    int burst, double secs)
+{
+	struct load_run *lr;
+	pthread_t consumer, producer;
+	size_t capacity;
+	double elapsed;
+	int error, fds[2];
+
+	lr = calloc(1, sizeof(*lr));
+	if (lr == NULL)
+		errx(1, "out of memory");
+	hdr_init(&lr->hist);
+	lr->dist = dist;
+	lr->rate = rate;
+	lr->burst = burst;
+	capacity = bench_channel(transport, bufsize, fds);
+	bench_io_init(&lr->rio, fds[0], wait, false);
+	bench_io_init(&lr->wio, fds[1], wait, true);
+
+	/* Leave time for both threads to start before the first send. */
+	lr->start = now_ns() + 10 * 1000000;
+	lr->end = lr->start + (uint64_t)(secs * 1e9);
+	error = pthread_create(&consumer, NULL, load_consumer, lr);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+	error = pthread_create(&producer, NULL, load_producer, lr);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+
+	elapsed = (lr->finish - lr->start) / 1e9;
+	printf("%-10s %-8s %10zu %10.0f %10.0f %10ju %10ju %10ju %10ju "
+	    "%10ju\n", bench_transport_names[transport],
+	    bench_wait_names[wait], capacity, rate, lr->sent / elapsed,
+	    (uintmax_t)hdr_percentile(&lr->hist, 50),
+	    (uintmax_t)hdr_percentile(&lr->hist, 99),
+	    (uintmax_t)hdr_percentile(&lr->hist, 99.9),
+	    (uintmax_t)lr->hist.max, (uintmax_t)lr->lag);
+	fflush(stdout);
+	free(lr);
+}
+
+/*
+ * Parse a size distribution: a fixed size ("64"), a uniform range
+ * ("64-4k"), or an exponential distribution with a mean ("exp:1k").
+ */
+static void
+load_parse_dist(const char *arg, struct load_dist *ld)
+{
+	const char *dash;
+	char *min;
+	uint64_t val;
+
+	if (strncmp(arg, "exp:", 4) == 0) {
+		if (expand_number(arg + 4, &val) != 0 || val == 0)
+			errx(1, "invalid mean size %s", arg + 4);
+		ld->kind = DIST_EXP;
+		ld->mean = val;
+		ld->min = sizeof(struct load_hdr);
+		ld->max = MAX(val * 16, sizeof(struct load_hdr));
+		return;
+	}
+	dash = strchr(arg, '-');
+	if (dash == NULL) {
+		if (expand_number(arg, &val) != 0)
+			errx(1, "invalid message size %s", arg);
+		ld->kind = DIST_FIXED;
+		ld->min = ld->max = val;
+	} else {
+		min = strndup(arg, dash - arg);
+		if (min == NULL)
+			errx(1, "out of memory");
+		if (expand_number(min, &val) != 0)
+			errx(1, "invalid message size %s", min);
+		free(min);
+		ld->min = val;
+		if (expand_number(dash + 1, &val) != 0)
+			errx(1, "invalid message size %s", dash + 1);
+		ld->max = val;
+		ld->kind = DIST_UNIFORM;
+	}
+	if (ld->min < sizeof(struct load_hdr) || ld->min > ld->max ||
+	    ld->max > 64 * 1024 * 1024)
+		errx(1, "message sizes must be between %zu and 64m bytes",
+		    sizeof(struct load_hdr));
+}
+
+/* Parse a comma-separated list of rates in messages per second. */
+static int
+load_parse_rates(const char *arg, double *rates)
+{
+	char *cp, *list, *p, *s;
+	int count;
+
+	list = strdup(arg);
+	if (list == NULL)
+		errx(1, "out of memory");
+	count = 0;
+	p = list;
+	while ((s = strsep(&p, ",")) != NULL) {
+		if (count == BENCH_MAXLIST)
+			errx(1, "too many rates");
+		rates[count] = strtod(s, &cp);
+		if (*cp != '\0' || rates[count] <= 0 || rates[count] > 1e9)
+			errx(1, "invalid rate %s", s);
+		count++;
+	}
+	free(list);
+	return (count);
+}
+
+/*
+ * Open-loop load generator.  Messages are written at fixed rates and
+ * their latency is measured from when they should have been sent.
+ * Each line reports one rate so the point where latency climbs can be
+ * found for each transport, buffer size and wait mode.  Latencies are
+ * reported in nanoseconds.
+ */
+void
+load(int argc, char **argv)
+{
+	size_t bufsizes[BENCH_MAXLIST];
+	double rates[BENCH_MAXLIST];
+	int transports[BENCH_MAXLIST], waits[BENCH_MAXLIST];
+	int nbufsizes, nrates, ntransports, nwaits;
+	struct load_dist dist;
+	const char *errstr;
+	int b, burst, ch, m, r, t;
+	size_t saved;
+	double secs;
+	char *cp;
+
+	argc--;
+	argv++;
+
+	bufsizes[0] = 0;
+	nbufsizes = 1;
+	rates[0] = 1000;
+	rates[1] = 10000;
+	rates[2] = 100000;
+	nrates = 3;
+	transports[0] = XPORT_ECHO;
+	ntransports = 1;
+	waits[0] = WAIT_BLOCK;
+	nwaits = 1;
+	burst = 1;
+	secs = 1;
+	load_parse_dist("64", &dist);
+	while ((ch = getopt(argc, argv, "b:B:m:r:s:t:T:")) != -1) {
+		switch (ch) {
+		case 'b':
+			burst = (int)strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "burst is %s", errstr);
+			break;
+		case 'B':
+			nbufsizes = bench_parse_sizes(optarg, bufsizes, 1,
+			    SSIZE_MAX, "buffer size");
+			break;
+		case 'm':
+			nwaits = bench_parse_names(optarg, bench_wait_names,
+			    nitems(bench_wait_names), waits, "mode");
+			break;
+		case 'r':
+			nrates = load_parse_rates(optarg, rates);
+			break;
+		case 's':
+			load_parse_dist(optarg, &dist);
+			break;
+		case 't':
+			secs = strtod(optarg, &cp);
+			if (*cp != '\0' || secs <= 0)
+				errx(1, "invalid time %s", optarg);
+			break;
+		case 'T':
+			ntransports = bench_parse_names(optarg,
+			    bench_transport_names,
+			    nitems(bench_transport_names), transports,
+			    "transport");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	/* Restore the buffer size of the instance afterwards if it changes. */
+	saved = 0;
+	for (t = 0; t < ntransports; t++)
+		if (transports[t] == XPORT_ECHO && bufsizes[0] != 0)
+			saved = bench_getsize();
+
+	printf("%-10s %-8s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+	    "transport", "mode", "bufsize", "rate", "achieved", "p50", "p99",
+	    "p99.9", "max", "lag");
+	for (b = 0; b < nbufsizes; b++)
+		for (m = 0; m < nwaits; m++)
+			for (t = 0; t < ntransports; t++)
+				for (r = 0; r < nrates; r++)
+					load_run(transports[t], bufsizes[b],
+					    waits[m], &dist, rates[r], burst,
+					    secs);
+
+	if (saved != 0)
+		bench_setsize(saved);
+}
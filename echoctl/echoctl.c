@@ -6,42 +6,231 @@
 
 #include <sys/event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/sysctl.h>
+#include <machine/atomic.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysdecode.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <echodev.h>
 
-static void
+#include "echoctl.h"
+
+const char *device = "/dev/echo";
+
+void
 usage(void)
 {
-	fprintf(stderr, "Usage: echoctl <command> ...\n"
+	fprintf(stderr, "Usage: echoctl [-d device] <command> ...\n"
 	    "\n"
 	    "Where command is one of:\n"
+	    "\tadvise [-t percent]\t- recommend a buffer size\n"
+	    "\taggregate <unit> ...\t- read tagged data from several units\n"
+	    "\tblocks [count size]\t- display or set block mode buffers\n"
+	    "\tbench [-w writers] [-r readers] [-b sizes] [-B bufsizes]\n"
+	    "\t      [-m modes] [-c affinity] [-T transports] [-t seconds]\n"
+	    "\t\t\t- measure throughput\n"
 	    "\tclear\t\t- clear buffer contents\n"
 	    "\tevents [-rwW]\t- display I/O status events\n"
+	    "\tlatency\t\t- display latency percentiles\n"
+	    "\tlink [unit|none]\t- display or set forwarding link\n"
+	    "\tload [-b burst] [-B bufsizes] [-m modes] [-r rates] [-s dist]\n"
+	    "\t      [-T transports] [-t seconds]\n"
+	    "\t\t\t- measure latency under a fixed load\n"
+	    "\tloan [0|1]\t- display or set page loan mode\n"
+	    "\tloanbench [-n count]\n"
+	    "\t\t\t- compare copied, direct, and loaned writes\n"
+	    "\tpingpong [-u] [-D device] [-m modes] [-n count] [-s sizes]\n"
+	    "\t      [-T transports] [-W warmup]\n"
+	    "\t\t\t- measure round-trip latency\n"
 	    "\tpoll [-rwW]\t- display I/O status\n"
+	    "\tpump [-q] [-b size] [-m method] in|out [file]\n"
+	    "\t\t\t- copy between the device and a file\n"
+	    "\trecords [0|1]\t- display or set record mode\n"
 	    "\tresize <size>\t- set buffer size\n"
-	    "\tsize\t\t- display buffer size\n");
+	    "\tring [size]\t- display or set shared ring size\n"
+	    "\tsize\t\t- display buffer size\n"
+	    "\tstats\t\t- display statistics\n"
+	    "\tstatus\t\t- display the status page\n"
+	    "\ttrace [-f]\t- decode events from /dev/echotrace\n");
 	exit(1);
 }
 
-static int
+int
 open_device(int flags)
 {
 	int fd;
 
-	fd = open("/dev/echo", flags);
+	fd = open(device, flags);
 	if (fd == -1)
-		err(1, "/dev/echo");
+		err(1, "%s", device);
 	return (fd);
 }
 
+/*
+ * Recommend a buffer size that would be full for at most the target
+ * percentage of the time.  Smaller sizes are estimated from the time
+ * the current buffer held at least that many bytes.  A buffer that is
+ * already full too often can only be grown and measured again.
+ */
+static void
+advise(int argc, char **argv)
+{
+	struct echodev_occupancy eo;
+	const char *errstr;
+	uint64_t above, size;
+	double pct, target;
+	int b, ch, fd, k;
+
+	argc--;
+	argv++;
+
+	target = 1.0;
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
+		switch (ch) {
+		case 't':
+			target = strtonum(optarg, 0, 100, &errstr);
+			if (errstr != NULL)
+				errx(1, "target is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	fd = open_device(O_RDONLY);
+	if (ioctl(fd, ECHODEV_GOCCUPANCY, &eo) == -1)
+		err(1, "ioctl(ECHODEV_GOCCUPANCY)");
+	close(fd);
+
+	if (eo.eo_total_ns == 0) {
+		printf("no data yet\n");
+		return;
+	}
+	pct = 100.0 * eo.eo_full_ns / eo.eo_total_ns;
+	printf("size %ju, high-water mark %ju\n", (uintmax_t)eo.eo_size,
+	    (uintmax_t)eo.eo_hwm);
+	printf("full %.2f%%, empty %.2f%%\n", pct,
+	    100.0 * eo.eo_empty_ns / eo.eo_total_ns);
+	printf("oldest unread byte %.3f ms, max %.3f ms\n",
+	    eo.eo_age_ns / 1e6, eo.eo_max_age_ns / 1e6);
+
+	if (pct > target) {
+		size = 64;
+		while (size < eo.eo_size * 2)
+			size *= 2;
+		printf("recommend at least %ju bytes and measuring again\n",
+		    (uintmax_t)size);
+		return;
+	}
+
+	for (k = 6; k < ECHODEV_OCC_BUCKETS - 1; k++) {
+		size = (uint64_t)1 << k;
+		if (size >= eo.eo_size)
+			break;
+		above = 0;
+		for (b = k + 1; b < ECHODEV_OCC_BUCKETS; b++)
+			above += eo.eo_time[b];
+		if (100.0 * above / eo.eo_total_ns <= target)
+			break;
+	}
+	if (size > eo.eo_size)
+		size = eo.eo_size;
+	printf("recommend %ju bytes (full %.2f%% of the time or less)\n",
+	    (uintmax_t)size, target);
+}
+
+static void
+aggregate(int argc, char **argv)
+{
+	struct echodev_agg_hdr hdr;
+	const char *errstr;
+	char *buf, *p;
+	ssize_t nread;
+	int fd, i, unit;
+
+	if (argc < 3)
+		usage();
+
+	fd = open_device(O_RDONLY);
+	for (i = 2; i < argc; i++) {
+		unit = (int)strtonum(argv[i], 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			err(1, "unit is %s", errstr);
+		if (ioctl(fd, ECHODEV_SUBSCRIBE, &unit) == -1)
+			err(1, "ioctl(ECHODEV_SUBSCRIBE)");
+	}
+
+	buf = malloc(65536);
+	if (buf == NULL)
+		err(1, "malloc");
+	for (;;) {
+		nread = read(fd, buf, 65536);
+		if (nread == -1)
+			err(1, "read");
+		p = buf;
+		while (p < buf + nread) {
+			/* Headers are not aligned after the first chunk. */
+			memcpy(&hdr, p, sizeof(hdr));
+			p += sizeof(hdr);
+			printf("echo%u: %.*s", hdr.eah_unit, (int)hdr.eah_len,
+			    p);
+			if (hdr.eah_len == 0 || p[hdr.eah_len - 1] != '\n')
+				printf("\n");
+			p += hdr.eah_len;
+		}
+		fflush(stdout);
+	}
+}
+
+static void
+blocks(int argc, char **argv)
+{
+	struct echodev_blocks eb;
+	const char *errstr;
+	int fd;
+
+	if (argc == 2) {
+		fd = open_device(O_RDONLY);
+		if (ioctl(fd, ECHODEV_GBLOCKS, &eb) == -1)
+			err(1, "ioctl(ECHODEV_GBLOCKS)");
+		close(fd);
+
+		printf("%u x %zu\n", eb.eb_count, eb.eb_size);
+		return;
+	}
+	if (argc != 4)
+		usage();
+
+	eb.eb_count = (u_int)strtonum(argv[2], 0, ECHODEV_BLOCKS_MAX, &errstr);
+	if (errstr != NULL)
+		err(1, "block count is %s", errstr);
+	eb.eb_size = (size_t)strtonum(argv[3], 0, ECHODEV_RING_MAX, &errstr);
+	if (errstr != NULL)
+		err(1, "block size is %s", errstr);
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_SBLOCKS, &eb) == -1)
+		err(1, "ioctl(ECHODEV_SBLOCKS)");
+	close(fd);
+}
+
 static void
 clear(int argc, char **argv)
 {
@@ -200,6 +389,298 @@ events(int argc, char **argv)
 	close(kq);
 }
 
+/* Returns the lower bound of the bucket holding a percentile. */
+static uint64_t
+hist_percentile(const struct echodev_hist *eh, uint64_t total, double pct)
+{
+	uint64_t count, target;
+	int i;
+
+	target = (uint64_t)(total * pct / 100.0);
+	count = 0;
+	for (i = 0; i < ECHODEV_HIST_BUCKETS; i++) {
+		count += eh->eh_buckets[i];
+		if (count > target)
+			return (ECHODEV_HIST_MIN(i));
+	}
+	return (ECHODEV_HIST_MIN(ECHODEV_HIST_BUCKETS - 1));
+}
+
+static void
+latency(int argc, char **argv)
+{
+	static const char *names[ECHODEV_HIST_COUNT] = {
+		"read", "write", "sleep", "wakeup"
+	};
+	struct echodev_hist eh;
+	uint64_t total;
+	int fd, i, j;
+
+	if (argc != 2)
+		usage();
+
+	fd = open_device(O_RDONLY);
+	printf("%-8s %12s %10s %10s %10s %10s\n", "ns", "count", "p50",
+	    "p90", "p99", "p99.9");
+	for (i = 0; i < ECHODEV_HIST_COUNT; i++) {
+		eh.eh_which = i;
+		if (ioctl(fd, ECHODEV_GHIST, &eh) == -1)
+			err(1, "ioctl(ECHODEV_GHIST)");
+		total = 0;
+		for (j = 0; j < ECHODEV_HIST_BUCKETS; j++)
+			total += eh.eh_buckets[j];
+		if (total == 0) {
+			printf("%-8s %12d\n", names[i], 0);
+			continue;
+		}
+		printf("%-8s %12ju %10ju %10ju %10ju %10ju\n", names[i],
+		    (uintmax_t)total,
+		    (uintmax_t)hist_percentile(&eh, total, 50),
+		    (uintmax_t)hist_percentile(&eh, total, 90),
+		    (uintmax_t)hist_percentile(&eh, total, 99),
+		    (uintmax_t)hist_percentile(&eh, total, 99.9));
+	}
+	close(fd);
+}
+
+static void
+link_cmd(int argc, char **argv)
+{
+	struct echodev_link_stats els;
+	const char *errstr;
+	int fd, unit;
+
+	if (argc == 2) {
+		fd = open_device(O_RDONLY);
+		if (ioctl(fd, ECHODEV_GLINK, &els) == -1)
+			err(1, "ioctl(ECHODEV_GLINK)");
+		close(fd);
+
+		if (els.el_unit == -1) {
+			printf("none\n");
+			return;
+		}
+		printf("unit %d: %ju bytes in %ju forwards, %ju empty, "
+		    "%ju full\n", els.el_unit, (uintmax_t)els.el_bytes,
+		    (uintmax_t)els.el_forwards, (uintmax_t)els.el_src_empty,
+		    (uintmax_t)els.el_dst_full);
+		return;
+	}
+	if (argc != 3)
+		usage();
+
+	if (strcmp(argv[2], "none") == 0)
+		unit = -1;
+	else {
+		unit = (int)strtonum(argv[2], 0, INT_MAX, &errstr);
+		if (errstr != NULL)
+			err(1, "unit is %s", errstr);
+	}
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_LINK, &unit) == -1)
+		err(1, "ioctl(ECHODEV_LINK)");
+	close(fd);
+}
+
+static void
+loan(int argc, char **argv)
+{
+	const char *errstr;
+	int fd, val;
+
+	if (argc == 2) {
+		fd = open_device(O_RDONLY);
+		if (ioctl(fd, ECHODEV_GLOAN, &val) == -1)
+			err(1, "ioctl(ECHODEV_GLOAN)");
+		close(fd);
+
+		printf("%d\n", val);
+		return;
+	}
+	if (argc != 3)
+		usage();
+
+	val = (int)strtonum(argv[2], 0, 1, &errstr);
+	if (errstr != NULL)
+		err(1, "loan mode is %s", errstr);
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_SLOAN, &val) == -1)
+		err(1, "ioctl(ECHODEV_SLOAN)");
+	close(fd);
+}
+
+struct loanbench_reader {
+	int	fd;
+	char	*buf;
+	size_t	len;
+	size_t	total;
+};
+
+static void *
+loanbench_read(void *arg)
+{
+	struct loanbench_reader *lr = arg;
+	size_t total;
+	ssize_t n;
+
+	total = lr->total;
+	while (total > 0) {
+		n = read(lr->fd, lr->buf, total < lr->len ? total : lr->len);
+		if (n == -1)
+			err(1, "read");
+		if (n == 0)
+			break;
+		total -= n;
+	}
+	return (NULL);
+}
+
+static void
+loanbench_direct(bool direct)
+{
+	if (sysctlbyname("hw.echo.direct", NULL, NULL, &direct,
+	    sizeof(direct)) == -1)
+		err(1, "sysctl(hw.echo.direct)");
+}
+
+/* Returns the throughput in MB/s of count writes of len bytes. */
+static double
+loanbench_run(int rfd, int wfd, size_t len, int count, int val, bool direct)
+{
+	struct loanbench_reader lr;
+	struct timespec start, end;
+	pthread_t thread;
+	char *buf, *p;
+	size_t resid;
+	ssize_t n;
+	double elapsed;
+	int error, i;
+
+	if (ioctl(wfd, ECHODEV_SLOAN, &val) == -1)
+		err(1, "ioctl(ECHODEV_SLOAN)");
+	loanbench_direct(direct);
+	if (posix_memalign((void **)&buf, getpagesize(), len) != 0 ||
+	    posix_memalign((void **)&lr.buf, getpagesize(), len) != 0)
+		errx(1, "out of memory");
+	memset(buf, 0xa5, len);
+	lr.fd = rfd;
+	lr.len = len;
+	lr.total = len * count;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = pthread_create(&thread, NULL, loanbench_read, &lr);
+	if (error != 0)
+		errc(1, error, "pthread_create");
+	for (i = 0; i < count; i++) {
+		p = buf;
+		resid = len;
+		while (resid > 0) {
+			n = write(wfd, p, resid);
+			if (n == -1)
+				err(1, "write");
+			p += n;
+			resid -= n;
+		}
+	}
+	pthread_join(thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free(lr.buf);
+	free(buf);
+	elapsed = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	return ((double)len * count / elapsed / (1024 * 1024));
+}
+
+/*
+ * Compare the throughput of page-aligned transfers across a range of
+ * sizes when copied through the buffer, when copied directly from the
+ * writer's pages (writes of at least 8KB with a waiting reader), and
+ * in loan mode.  Loan mode still copies once; it differs from direct
+ * writes only in using larger chunks for any whole-page write.
+ */
+static void
+loanbench(int argc, char **argv)
+{
+	const char *errstr;
+	size_t len, olen;
+	int ch, count, rfd, saved, wfd;
+	bool direct;
+
+	argc--;
+	argv++;
+
+	count = 1000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = (int)strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				err(1, "count is %s", errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	wfd = open_device(O_RDWR);
+	rfd = open_device(O_RDONLY);
+	if (ioctl(wfd, ECHODEV_GLOAN, &saved) == -1)
+		err(1, "ioctl(ECHODEV_GLOAN)");
+	olen = sizeof(direct);
+	if (sysctlbyname("hw.echo.direct", &direct, &olen, NULL, 0) == -1)
+		err(1, "sysctl(hw.echo.direct)");
+
+	printf("%10s %12s %12s %12s\n", "size", "copy MB/s", "direct MB/s",
+	    "loan MB/s");
+	for (len = getpagesize(); len <= 1024 * 1024; len *= 2)
+		printf("%10zu %12.1f %12.1f %12.1f\n", len,
+		    loanbench_run(rfd, wfd, len, count, 0, false),
+		    loanbench_run(rfd, wfd, len, count, 0, true),
+		    loanbench_run(rfd, wfd, len, count, 1, true));
+
+	loanbench_direct(direct);
+	if (ioctl(wfd, ECHODEV_SLOAN, &saved) == -1)
+		err(1, "ioctl(ECHODEV_SLOAN)");
+	close(rfd);
+	close(wfd);
+}
+
+static void
+records(int argc, char **argv)
+{
+	const char *errstr;
+	int fd, val;
+
+	if (argc == 2) {
+		fd = open_device(O_RDONLY);
+		if (ioctl(fd, ECHODEV_GRECORDS, &val) == -1)
+			err(1, "ioctl(ECHODEV_GRECORDS)");
+		close(fd);
+
+		printf("%d\n", val);
+		return;
+	}
+	if (argc != 3)
+		usage();
+
+	val = (int)strtonum(argv[2], 0, 1, &errstr);
+	if (errstr != NULL)
+		err(1, "record mode is %s", errstr);
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_SRECORDS, &val) == -1)
+		err(1, "ioctl(ECHODEV_SRECORDS)");
+	close(fd);
+}
+
 static void
 resize(int argc, char **argv)
 {
@@ -220,6 +701,35 @@ resize(int argc, char **argv)
 	close(fd);
 }
 
+static void
+ring(int argc, char **argv)
+{
+	const char *errstr;
+	size_t len;
+	int fd;
+
+	if (argc == 2) {
+		fd = open_device(O_RDONLY);
+		if (ioctl(fd, ECHODEV_GRING, &len) == -1)
+			err(1, "ioctl(ECHODEV_GRING)");
+		close(fd);
+
+		printf("%zu\n", len);
+		return;
+	}
+	if (argc != 3)
+		usage();
+
+	len = (size_t)strtonum(argv[2], 0, ECHODEV_RING_MAX, &errstr);
+	if (errstr != NULL)
+		err(1, "ring size is %s", errstr);
+
+	fd = open_device(O_RDWR);
+	if (ioctl(fd, ECHODEV_SRING, &len) == -1)
+		err(1, "ioctl(ECHODEV_SRING)");
+	close(fd);
+}
+
 static void
 size(int argc, char **argv)
 {
@@ -237,22 +747,230 @@ size(int argc, char **argv)
 	printf("%zu\n", len);
 }
 
+static void
+stats(int argc, char **argv)
+{
+	struct echodev_stats es;
+	int fd;
+
+	if (argc != 2)
+		usage();
+
+	fd = open_device(O_RDONLY);
+	if (ioctl(fd, ECHODEV_GSTATS, &es) == -1)
+		err(1, "ioctl(ECHODEV_GSTATS)");
+	close(fd);
+
+	printf("read:  %ju bytes in %ju calls, %ju would block, %ju sleeps\n",
+	    (uintmax_t)es.es_read_bytes, (uintmax_t)es.es_read_calls,
+	    (uintmax_t)es.es_read_wouldblock, (uintmax_t)es.es_read_sleeps);
+	printf("write: %ju bytes in %ju calls, %ju would block, %ju sleeps\n",
+	    (uintmax_t)es.es_write_bytes, (uintmax_t)es.es_write_calls,
+	    (uintmax_t)es.es_write_wouldblock, (uintmax_t)es.es_write_sleeps);
+	printf("%ju wakeups, %ju resizes, %ju clears\n",
+	    (uintmax_t)es.es_wakeups, (uintmax_t)es.es_resizes,
+	    (uintmax_t)es.es_clears);
+}
+
+/* Copy a consistent snapshot of the status page. */
+static void
+status_snapshot(const struct echodev_status *st, struct echodev_status *copy)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = atomic_load_acq_32(&st->es_seq);
+		if ((seq & 1) != 0)
+			continue;
+		memcpy(copy, __DEVOLATILE(void *, st), sizeof(*copy));
+		atomic_thread_fence_acq();
+		if (st->es_seq == seq)
+			break;
+	}
+}
+
+static void
+status_page(int argc, char **argv)
+{
+	struct echodev_status *st, copy;
+	int fd;
+
+	if (argc != 2)
+		usage();
+
+	fd = open_device(O_RDONLY);
+	st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd,
+	    ECHODEV_STATUS_OFFSET);
+	if (st == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	status_snapshot(st, &copy);
+	munmap(st, sizeof(*st));
+
+	printf("%ju of %ju bytes valid, %ju free, %u writers\n",
+	    (uintmax_t)copy.es_valid, (uintmax_t)copy.es_len,
+	    (uintmax_t)copy.es_space, copy.es_writers);
+	printf("read:  %ju bytes in %ju calls\n",
+	    (uintmax_t)copy.es_stats.es_read_bytes,
+	    (uintmax_t)copy.es_stats.es_read_calls);
+	printf("write: %ju bytes in %ju calls\n",
+	    (uintmax_t)copy.es_stats.es_write_bytes,
+	    (uintmax_t)copy.es_stats.es_write_calls);
+}
+
+static int
+trace_compare(const void *a, const void *b)
+{
+	const struct echodev_trace_event *ea = a, *eb = b;
+
+	if (ea->ete_time < eb->ete_time)
+		return (-1);
+	return (ea->ete_time > eb->ete_time);
+}
+
+static const char *
+trace_type(u_int type)
+{
+	static const char *names[] = {
+		[ECHODEV_TRACE_READ] = "read",
+		[ECHODEV_TRACE_WRITE] = "write",
+		[ECHODEV_TRACE_SLEEP] = "sleep",
+		[ECHODEV_TRACE_WAKEUP] = "wakeup",
+		[ECHODEV_TRACE_NOTIFY_READ] = "notify-read",
+		[ECHODEV_TRACE_NOTIFY_WRITE] = "notify-write",
+		[ECHODEV_TRACE_RESIZE] = "resize",
+		[ECHODEV_TRACE_CLEAR] = "clear",
+	};
+
+	if (type >= nitems(names) || names[type] == NULL)
+		return ("unknown");
+	return (names[type]);
+}
+
+/*
+ * Events are only ordered within each CPU, so each batch is sorted by
+ * timestamp before it is displayed.
+ */
+static void
+trace(int argc, char **argv)
+{
+	struct echodev_trace_event *evs;
+	uint64_t freq, t0;
+	size_t len;
+	ssize_t nread;
+	int ch, fd, i, n;
+	bool follow;
+
+	argc--;
+	argv++;
+
+	follow = false;
+	while ((ch = getopt(argc, argv, "f")) != -1) {
+		switch (ch) {
+		case 'f':
+			follow = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	len = sizeof(freq);
+	if (sysctlbyname("hw.echo.trace_freq", &freq, &len, NULL, 0) == -1)
+		err(1, "sysctl(hw.echo.trace_freq)");
+	if (freq == 0)
+		errx(1, "unknown trace timestamp frequency");
+
+	fd = open("/dev/echotrace", O_RDONLY | (follow ? 0 : O_NONBLOCK));
+	if (fd == -1)
+		err(1, "/dev/echotrace");
+
+	evs = calloc(1024, sizeof(*evs));
+	if (evs == NULL)
+		err(1, "calloc");
+	t0 = 0;
+	for (;;) {
+		nread = read(fd, evs, 1024 * sizeof(*evs));
+		if (nread == -1) {
+			if (errno == EAGAIN)
+				break;
+			err(1, "read");
+		}
+		n = nread / sizeof(*evs);
+		qsort(evs, n, sizeof(*evs), trace_compare);
+		if (t0 == 0 && n != 0)
+			t0 = evs[0].ete_time;
+		for (i = 0; i < n; i++)
+			printf("%14.3f cpu%-3u echo%-4u %-12s %ju\n",
+			    (double)(int64_t)(evs[i].ete_time - t0) * 1000000 /
+			    freq,
+			    evs[i].ete_cpu, evs[i].ete_unit,
+			    trace_type(evs[i].ete_type),
+			    (uintmax_t)evs[i].ete_arg);
+		fflush(stdout);
+	}
+	free(evs);
+	close(fd);
+}
+
 int
 main(int argc, char **argv)
 {
+	if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+		device = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc < 2)
 		usage();
 
-	if (strcmp(argv[1], "clear") == 0)
+	if (strcmp(argv[1], "advise") == 0)
+		advise(argc, argv);
+	else if (strcmp(argv[1], "aggregate") == 0)
+		aggregate(argc, argv);
+	else if (strcmp(argv[1], "bench") == 0)
+		bench(argc, argv);
+	else if (strcmp(argv[1], "blocks") == 0)
+		blocks(argc, argv);
+	else if (strcmp(argv[1], "clear") == 0)
 		clear(argc, argv);
 	else if (strcmp(argv[1], "events") == 0)
 		events(argc, argv);
+	else if (strcmp(argv[1], "latency") == 0)
+		latency(argc, argv);
+	else if (strcmp(argv[1], "link") == 0)
+		link_cmd(argc, argv);
+	else if (strcmp(argv[1], "load") == 0)
+		load(argc, argv);
+	else if (strcmp(argv[1], "loan") == 0)
+		loan(argc, argv);
+	else if (strcmp(argv[1], "loanbench") == 0)
+		loanbench(argc, argv);
+	else if (strcmp(argv[1], "pingpong") == 0)
+		pingpong(argc, argv);
 	else if (strcmp(argv[1], "poll") == 0)
 		status(argc, argv);
+	else if (strcmp(argv[1], "pump") == 0)
+		pump(argc, argv);
+	else if (strcmp(argv[1], "records") == 0)
+		records(argc, argv);
 	else if (strcmp(argv[1], "resize") == 0)
 		resize(argc, argv);
+	else if (strcmp(argv[1], "ring") == 0)
+		ring(argc, argv);
 	else if (strcmp(argv[1], "size") == 0)
 		size(argc, argv);
+	else if (strcmp(argv[1], "stats") == 0)
+		stats(argc, argv);
+	else if (strcmp(argv[1], "status") == 0)
+		status_page(argc, argv);
+	else if (strcmp(argv[1], "trace") == 0)
+		trace(argc, argv);
 	else
 		usage();
 
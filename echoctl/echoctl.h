@@ -0,0 +1,23 @@
+/*-
+ * Copyright (c) 2024 John Baldwin <jhb@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __ECHOCTL_H__
+#define	__ECHOCTL_H__
+
+extern const char *device;
+
+int	open_device(int flags);
+void	usage(void) __dead2;
+
+/* bench.c */
+void	bench(int argc, char **argv);
+void	load(int argc, char **argv);
+void	pingpong(int argc, char **argv);
+
+/* pump.c */
+void	pump(int argc, char **argv);
+
+#endif /* !__ECHOCTL_H__ */
@@ -0,0 +1,374 @@
+/*-
+ * Copyright (c) 2024 John Baldwin <jhb@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libutil.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <echodev.h>
+#include <echodev_ring.h>
+
+#include "echoctl.h"
+
+enum pump_method {
+	PUMP_AUTO,
+	PUMP_COPY,
+	PUMP_SPLICE,
+	PUMP_RING,
+};
+
+static const char *pump_method_names[] = {
+	[PUMP_AUTO] = "auto",
+	[PUMP_COPY] = "copy",
+	[PUMP_SPLICE] = "splice",
+	[PUMP_RING] = "ring",
+};
+
+static volatile sig_atomic_t pump_stop;
+
+/* Descriptor flags to restore if pump_copy() exits early. */
+static int pump_fds[2], pump_oflags[2];
+static bool pump_saved;
+
+static void
+pump_sigint(int sig __unused)
+{
+	pump_stop = 1;
+}
+
+/*
+ * Build the iovecs describing len bytes of a circular buffer starting
+ * at offset pos.  Returns the number of iovecs used.
+ */
+static int
+pump_iov(char *buf, size_t size, uint64_t pos, size_t len,
+    struct iovec iov[2])
+{
+	size_t off;
+
+	off = pos % size;
+	iov[0].iov_base = buf + off;
+	iov[0].iov_len = MIN(len, size - off);
+	if (iov[0].iov_len == len)
+		return (1);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return (2);
+}
+
+static void
+pump_restore(void)
+{
+	if (!pump_saved)
+		return;
+	fcntl(pump_fds[0], F_SETFL, pump_oflags[0]);
+	fcntl(pump_fds[1], F_SETFL, pump_oflags[1]);
+	pump_saved = false;
+}
+
+/*
+ * Copy through a circular staging buffer using non-blocking readv(2)
+ * and writev(2).  Reads and writes proceed independently, and kqueue
+ * is only used to wait when neither side can make progress.  The
+ * original descriptor flags are restored on exit, including by err().
+ */
+static uint64_t
+pump_copy(int in, int out, size_t size)
+{
+	struct kevent kev[2];
+	struct iovec iov[2];
+	uint64_t head, tail;
+	ssize_t n;
+	char *buf;
+	int iovcnt, kq, nkev;
+	bool eof, progress, want_read, want_write;
+
+	if (posix_memalign((void **)&buf, getpagesize(), size) != 0)
+		errx(1, "out of memory");
+	kq = kqueue();
+	if (kq == -1)
+		err(1, "kqueue");
+	pump_fds[0] = in;
+	pump_fds[1] = out;
+	pump_oflags[0] = fcntl(in, F_GETFL);
+	pump_oflags[1] = fcntl(out, F_GETFL);
+	if (pump_oflags[0] == -1 || pump_oflags[1] == -1)
+		err(1, "fcntl(F_GETFL)");
+	pump_saved = true;
+	atexit(pump_restore);
+	if (fcntl(in, F_SETFL, pump_oflags[0] | O_NONBLOCK) == -1 ||
+	    fcntl(out, F_SETFL, pump_oflags[1] | O_NONBLOCK) == -1)
+		err(1, "fcntl(O_NONBLOCK)");
+
+	head = tail = 0;
+	eof = false;
+	for (;;) {
+		progress = want_read = want_write = false;
+		if (!eof && head - tail < size) {
+			iovcnt = pump_iov(buf, size, head, size - (head - tail),
+			    iov);
+			n = readv(in, iov, iovcnt);
+			if (n > 0) {
+				head += n;
+				progress = true;
+			} else if (n == 0)
+				eof = true;
+			else if (errno == EAGAIN)
+				want_read = true;
+			else if (errno != EINTR)
+				err(1, "read");
+		}
+		if (head != tail) {
+			iovcnt = pump_iov(buf, size, tail, head - tail, iov);
+			n = writev(out, iov, iovcnt);
+			if (n > 0) {
+				tail += n;
+				progress = true;
+			} else if (n == -1 && errno == EAGAIN)
+				want_write = true;
+			else if (n == -1 && errno != EINTR)
+				err(1, "write");
+		}
+		if (eof && head == tail)
+			break;
+		if (progress || (!want_read && !want_write))
+			continue;
+
+		nkev = 0;
+		if (want_read) {
+			EV_SET(&kev[nkev], in, EVFILT_READ,
+			    EV_ADD | EV_ONESHOT, 0, 0, NULL);
+			nkev++;
+		}
+		if (want_write) {
+			EV_SET(&kev[nkev], out, EVFILT_WRITE,
+			    EV_ADD | EV_ONESHOT, 0, 0, NULL);
+			nkev++;
+		}
+		if (kevent(kq, kev, nkev, kev, 1, NULL) == -1 &&
+		    errno != EINTR)
+			err(1, "kevent");
+	}
+
+	pump_restore();
+	close(kq);
+	free(buf);
+	return (tail);
+}
+
+/*
+ * Move data in the kernel with ECHODEV_SPLICE_IN or
+ * ECHODEV_SPLICE_OUT.  Returns false if the instance cannot splice, in
+ * which case nothing has been moved.
+ */
+static bool
+pump_splice(int dev, int other, bool in, size_t size, uint64_t *totalp)
+{
+	struct echodev_splice es;
+	uint64_t total;
+
+	total = 0;
+	for (;;) {
+		es.es_fd = other;
+		es.es_len = size;
+		if (ioctl(dev, in ? ECHODEV_SPLICE_IN : ECHODEV_SPLICE_OUT,
+		    &es) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (total == 0 && (errno == EINVAL || errno == ENOTTY))
+				return (false);
+			err(1, "ioctl(%s)", in ? "ECHODEV_SPLICE_IN" :
+			    "ECHODEV_SPLICE_OUT");
+		}
+		if (es.es_len == 0)
+			break;
+		total += es.es_len;
+	}
+	*totalp = total;
+	return (true);
+}
+
+/*
+ * Read or write a shared ring in place.  Input is read directly into
+ * the ring.  Rings have no end of file, so output runs until
+ * interrupted.
+ */
+static uint64_t
+pump_ring(int dev, int other, bool in)
+{
+	struct echodev_ring_handle h;
+	const void *cp;
+	uint64_t total;
+	ssize_t n;
+	size_t len;
+	void *p;
+
+	if (echodev_ring_attach(&h, dev) == -1)
+		err(1, "ring attach");
+	total = 0;
+	while (!pump_stop) {
+		if (in) {
+			len = echodev_ring_reserve(&h, &p);
+			if (len == 0) {
+				echodev_ring_wait(&h, POLLOUT, INFTIM);
+				continue;
+			}
+			n = read(other, p, len);
+			if (n == 0)
+				break;
+			if (n > 0)
+				echodev_ring_commit(&h, n);
+		} else {
+			len = echodev_ring_peek(&h, &cp);
+			if (len == 0) {
+				echodev_ring_wait(&h, POLLIN, 100);
+				continue;
+			}
+			n = write(other, cp, len);
+			if (n > 0)
+				echodev_ring_release(&h, n);
+		}
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, in ? "read" : "write");
+		}
+		total += n;
+	}
+	echodev_ring_detach(&h);
+	return (total);
+}
+
+/*
+ * Move data between the device and a file, pipe, or standard input
+ * or output.  The fastest method the instance supports is used unless
+ * one is requested.  Since a ring has no end of file, draining one
+ * runs until interrupted and must be requested with -m ring.
+ */
+void
+pump(int argc, char **argv)
+{
+	struct timespec start, end;
+	enum pump_method method;
+	const char *path;
+	uint64_t total, val;
+	size_t ringsize, size;
+	double elapsed;
+	int ch, dev, i, other;
+	bool in, quiet;
+
+	argc--;
+	argv++;
+
+	method = PUMP_AUTO;
+	quiet = false;
+	size = 1024 * 1024;
+	while ((ch = getopt(argc, argv, "b:m:q")) != -1) {
+		switch (ch) {
+		case 'b':
+			if (expand_number(optarg, &val) != 0 || val == 0 ||
+			    val > SSIZE_MAX)
+				errx(1, "invalid buffer size %s", optarg);
+			size = val;
+			break;
+		case 'm':
+			for (i = 0; i < (int)nitems(pump_method_names); i++)
+				if (strcmp(optarg, pump_method_names[i]) == 0)
+					break;
+			if (i == (int)nitems(pump_method_names))
+				errx(1, "invalid method %s", optarg);
+			method = i;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || argc > 2)
+		usage();
+	if (strcmp(argv[0], "in") == 0)
+		in = true;
+	else if (strcmp(argv[0], "out") == 0)
+		in = false;
+	else
+		usage();
+	path = argc == 2 && strcmp(argv[1], "-") != 0 ? argv[1] : NULL;
+
+	dev = open_device(in ? O_WRONLY : O_RDONLY);
+	if (ioctl(dev, ECHODEV_GRING, &ringsize) == -1)
+		ringsize = 0;
+	if (method == PUMP_AUTO) {
+		if (ringsize != 0 && !in)
+			errx(1, "%s is in ring mode; use -m ring", device);
+		method = ringsize != 0 ? PUMP_RING : PUMP_SPLICE;
+	}
+	if (method == PUMP_RING) {
+		if (ringsize == 0)
+			errx(1, "%s is not in ring mode", device);
+
+		/* Shared rings must be opened for reading and writing. */
+		close(dev);
+		dev = open_device(O_RDWR);
+	}
+
+	if (path == NULL)
+		other = in ? STDIN_FILENO : STDOUT_FILENO;
+	else {
+		other = in ? open(path, O_RDONLY) :
+		    open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (other == -1)
+			err(1, "%s", path);
+	}
+
+	signal(SIGINT, pump_sigint);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	switch (method) {
+	case PUMP_RING:
+		total = pump_ring(dev, other, in);
+		break;
+	case PUMP_SPLICE:
+		if (pump_splice(dev, other, in, size, &total))
+			break;
+		method = PUMP_COPY;
+		/* FALLTHROUGH */
+	default:
+		total = in ? pump_copy(other, dev, size) :
+		    pump_copy(dev, other, size);
+		break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (path != NULL)
+		close(other);
+	close(dev);
+
+	if (quiet)
+		return;
+	elapsed = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%ju bytes in %.3f seconds (%.1f MB/s) using %s\n",
+	    (uintmax_t)total, elapsed,
+	    elapsed > 0 ? total / elapsed / (1024 * 1024) : 0,
+	    pump_method_names[method]);
+}
@@ -5,34 +5,455 @@
  */
 
 #include <sys/param.h>
+#include <sys/aio.h>
+#include <sys/buf.h>
+#include <sys/capsicum.h>
 #include <sys/conf.h>
+#include <sys/counter.h>
 #include <sys/fcntl.h>
+#include <sys/file.h>
+#include <sys/filedesc.h>
 #include <sys/filio.h>
 #include <sys/kernel.h>
 #include <sys/limits.h>
+#include <sys/lock.h>
 #include <sys/malloc.h>
 #include <sys/module.h>
+#include <sys/mutex.h>
 #include <sys/poll.h>
+#include <sys/proc.h>
+#include <sys/queue.h>
+#include <sys/refcount.h>
+#include <sys/rwlock.h>
+#include <sys/sdt.h>
 #include <sys/selinfo.h>
+#include <sys/smp.h>
+#include <sys/sigio.h>
+#include <sys/signalvar.h>
+#include <sys/stat.h>
 #include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 #include <sys/uio.h>
+#include <sys/user.h>
+
+#include <machine/atomic.h>
+
+#include <vm/vm.h>
+#include <vm/vm_param.h>
+#include <vm/pmap.h>
+#include <vm/vm_extern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_pager.h>
 
 #include "echodev.h"
+#include "echodev_kpi.h"
+
+/*
+ * Blocking writes of at least ECHO_DIRECT_MIN bytes to an empty
+ * buffer with a waiting reader are copied directly from the writer's
+ * pages to the reader unless hw.echo.direct is cleared.  In loan
+ * mode, page-aligned writes of whole pages with a waiting reader are
+ * copied the same way in chunks of up to ECHO_LOAN_MAX bytes.
+ */
+#define	ECHO_DIRECT_MIN		8192
+#define	ECHO_DIRECT_MAX		65536
+#define	ECHO_LOAN_MAX		(256 * 1024)
+#define	ECHO_DIRECT_NPAGES	(ECHO_LOAN_MAX / PAGE_SIZE + 1)
+
+/* Size of the bounce buffer used to splice to and from other files. */
+#define	ECHO_SPLICE_MAX		65536
+
+/* Number of events in each CPU's trace ring.  Must be a power of 2. */
+#define	ECHO_TRACE_ENTRIES	4096
+
+/* Number of write timestamps kept to track the oldest unread byte. */
+#define	ECHO_OCC_MARKS		64
+
+/* Limit on data staged by echodev_enqueue_nosleep() per instance. */
+#define	ECHO_KPI_STAGE_MAX	(256 * 1024)
+
+/* Maximum number of queued records in record mode. */
+#define	ECHO_RECORDS_MAX	1024
+
+/* Maximum number of instances. */
+#define	ECHO_UNITS_MAX		4096
+
+/*
+ * Storage for a shared ring.  The ring header and data are backed by
+ * wired pages in a VM object which is mapped into the kernel and can
+ * be mapped into user processes via mmap(2).
+ */
+struct echodev_ringbuf {
+	struct echodev_ring *hdr;
+	vm_object_t obj;
+	vm_page_t *pages;
+	size_t size;
+	size_t mapsize;
+};
+
+/*
+ * Buffers exchanged between a producer and consumer in block mode.
+ * Each buffer is owned by one side at a time.  Buffers move from the
+ * free queue to the producer, from the producer to the filled queue,
+ * from the filled queue to the consumer, and back to the free queue.
+ */
+enum echodev_block_state {
+	EB_FREE,
+	EB_PRODUCER,
+	EB_FILLED,
+	EB_CONSUMER
+};
+
+struct echodev_blockset {
+	vm_object_t obj;
+	size_t size;
+	u_int count;
+	enum echodev_block_state *state;
+	size_t *lens;
+	u_int *freeq;
+	u_int free_head;
+	u_int free_count;
+	u_int *filledq;
+	u_int filled_head;
+	u_int filled_count;
+};
+
+/*
+ * A message in record mode.  Inline records hold a copy of the data.
+ * Reference records hold a reference on a shared memory object and
+ * describe a region of it.
+ */
+struct echodev_record {
+	STAILQ_ENTRY(echodev_record) link;
+	struct file *fp;
+	off_t offset;
+	size_t len;
+	char data[];
+};
+
+STAILQ_HEAD(echodev_records, echodev_record);
+
+/*
+ * A link forwards data from the buffer of one instance to the buffer
+ * of another.  The forwarding task runs whenever the source has new
+ * data or the destination frees space.
+ */
+struct echodev_link {
+	struct echodev_softc *src;
+	struct echodev_softc *dst;
+	struct task task;
+	TAILQ_ENTRY(echodev_link) dst_link;
+	counter_u64_t bytes;
+	counter_u64_t forwards;
+	counter_u64_t src_empty;
+	counter_u64_t dst_full;
+	char buf[ECHO_SPLICE_MAX];
+};
+
+/*
+ * An aggregator descriptor reads tagged data from a set of subscribed
+ * instances.  Instances with data are queued on a ready list when they
+ * notify readers so that reads and polling do not scan every
+ * subscription.
+ */
+struct echodev_sub {
+	struct echodev_agg *agg;
+	struct echodev_softc *sc;
+	TAILQ_ENTRY(echodev_sub) sc_link;
+	TAILQ_ENTRY(echodev_sub) agg_link;
+	TAILQ_ENTRY(echodev_sub) ready_link;
+	bool ready;
+};
+
+/*
+ * The subscription lock serializes subscription changes against each
+ * other and against readers using a subscription they dequeued.  It
+ * is ordered before instance locks, which are ordered before mtx.
+ */
+struct echodev_agg {
+	struct sx sublock;
+	struct mtx mtx;
+	struct selinfo sel;
+	TAILQ_HEAD(, echodev_sub) subs;
+	TAILQ_HEAD(, echodev_sub) ready;
+	u_int nready;
+};
+
+/*
+ * Per-instance statistics.  The order matches the fields of struct
+ * echodev_stats.
+ */
+enum echodev_stat {
+	ES_READ_BYTES,
+	ES_READ_CALLS,
+	ES_READ_WOULDBLOCK,
+	ES_READ_SLEEPS,
+	ES_WRITE_BYTES,
+	ES_WRITE_CALLS,
+	ES_WRITE_WOULDBLOCK,
+	ES_WRITE_SLEEPS,
+	ES_WAKEUPS,
+	ES_RESIZES,
+	ES_CLEARS,
+	ES_NSTATS
+};
+
+CTASSERT(sizeof(struct echodev_stats) == ES_NSTATS * sizeof(uint64_t));
+
+static const struct {
+	const char *name;
+	const char *descr;
+} echo_stat_info[ES_NSTATS] = {
+	{ "read_bytes", "Bytes read" },
+	{ "read_calls", "Read requests" },
+	{ "read_wouldblock", "Reads failed with EWOULDBLOCK" },
+	{ "read_sleeps", "Sleeps waiting for data" },
+	{ "write_bytes", "Bytes written" },
+	{ "write_calls", "Write requests" },
+	{ "write_wouldblock", "Writes failed with EWOULDBLOCK" },
+	{ "write_sleeps", "Sleeps waiting for space" },
+	{ "wakeups", "Wakeups of sleeping threads" },
+	{ "resizes", "Buffer resizes" },
+	{ "clears", "Buffer clears" },
+};
+
+/*
+ * Lock profiling for each class of caller.  The maximum hold time is
+ * only tracked for exclusive holds.  LS_IOCTL also covers open, close
+ * and other control operations, and LS_POLL the status page.
+ */
+enum echodev_lock_site {
+	LS_READ,
+	LS_WRITE,
+	LS_POLL,
+	LS_IOCTL,
+	LS_KNOTE,
+	LS_COUNT
+};
+
+struct echodev_lockprof {
+	counter_u64_t acquires;
+	counter_u64_t contended;
+	counter_u64_t wait_ns;
+	uint64_t max_hold_ns;
+};
+
+struct echo_trace_ring {
+	u_int head;		/* written by the owning CPU */
+	u_int tail;		/* protected by echo_trace_lock */
+	struct echodev_trace_event ev[ECHO_TRACE_ENTRIES];
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * Buffer occupancy tracking.  Time is charged to the occupancy the
+ * buffer held until each change.  Each write records the time and the
+ * total bytes written so far, so the oldest mark that has not been
+ * fully read gives the age of the oldest unread byte.
+ */
+struct echodev_occ {
+	uint64_t time[ECHODEV_OCC_BUCKETS];
+	uint64_t full_ns;
+	uint64_t empty_ns;
+	uint64_t max_age_ns;
+	size_t hwm;
+	size_t last_valid;
+	sbintime_t last_time;
+	uint64_t written;
+	uint64_t read;
+	struct {
+		uint64_t end;
+		sbintime_t time;
+	} marks[ECHO_OCC_MARKS];
+	u_int mark_head;
+	u_int mark_count;
+};
+
+/* A thread sleeping in echo_sleep() and the time it was woken. */
+struct echodev_sleeper {
+	LIST_ENTRY(echodev_sleeper) link;
+	sbintime_t woken;
+};
+
+/* Data staged by echodev_enqueue_nosleep(). */
+struct echodev_kbuf {
+	STAILQ_ENTRY(echodev_kbuf) link;
+	size_t len;
+	size_t off;
+	char data[];
+};
 
 struct echodev_softc {
 	struct cdev *dev;
+	struct cdev *alias;
+	struct echodev_softc *peer;
+	u_int pair1_open;
+	int unit;
 	char *buf;
 	size_t len;
 	size_t valid;
+	size_t reserved;
+	size_t resize_len;
 	struct sx lock;
 	struct selinfo rsel;
 	struct selinfo wsel;
+	LIST_HEAD(, echodev_file) rasync;
+	LIST_HEAD(, echodev_file) wasync;
+	struct echodev_ringbuf *ring;
+	struct echodev_blockset *blocks;
+	vm_page_t direct_pages[ECHO_DIRECT_NPAGES];
+	int direct_npages;
+	size_t direct_off;
+	size_t direct_len;
+	struct echodev_records records;
+	u_int nrecords;
+	size_t record_bytes;
+	struct echodev_link *out_link;
+	TAILQ_HEAD(, echodev_link) in_links;
+	TAILQ_HEAD(, echodev_sub) subs;
+	TAILQ_HEAD(, kaiocb) aio_rjobs;
+	TAILQ_HEAD(, kaiocb) aio_wjobs;
+	struct mtx kpi_mtx;
+	STAILQ_HEAD(, echodev_kbuf) kpi_bufs;
+	size_t kpi_staged;
+	struct task kpi_task;
+	counter_u64_t stats[ES_NSTATS];
+	counter_u64_t hist[ECHODEV_HIST_COUNT][ECHODEV_HIST_BUCKETS];
+	LIST_HEAD(, echodev_sleeper) sleepers;
+	struct echodev_lockprof lockprof[LS_COUNT];
+	struct echodev_occ occ;
+	struct echodev_status *status;
+	vm_object_t status_obj;
+	vm_page_t status_page;
+	struct timeout_task status_task;
+	bool status_armed;
+	int lock_site;
+	sbintime_t lock_time;
+	struct sysctl_ctx_list sysctl_ctx;
+	u_int rwaiters;
+	u_int splicers;
 	u_int writers;
 	bool dying;
+	bool resizing;
+	bool direct_active;
+	bool splice_busy;
+	bool loan;
+	bool record_mode;
+	bool peer_reserved;
+};
+
+/*
+ * Per-descriptor state.  Normally a descriptor reads and writes the
+ * same instance.  An endpoint of a pair reads from one direction and
+ * writes to the other.
+ */
+struct echodev_file {
+	struct echodev_softc *rsc;
+	struct echodev_softc *wsc;
+	struct echodev_agg *agg;
+	struct sigio *sigio;
+	int fflag;
+	LIST_ENTRY(echodev_file) rasync_link;
+	LIST_ENTRY(echodev_file) wasync_link;
+	bool async;
 };
 
 static MALLOC_DEFINE(M_ECHODEV, "echodev", "Demo echo character device");
 
+static SYSCTL_NODE(_hw, OID_AUTO, echo, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "Demo echo character device");
+
+static SYSCTL_NODE(_dev, OID_AUTO, echo, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "Demo echo character devices");
+
+static u_int echo_units = 1;
+SYSCTL_UINT(_hw_echo, OID_AUTO, units, CTLFLAG_RDTUN, &echo_units, 0,
+    "Number of echo devices");
+
+SDT_PROVIDER_DEFINE(echodev);
+SDT_PROBE_DEFINE2(echodev, , read, entry, "struct echodev_softc *",
+    "ssize_t");
+SDT_PROBE_DEFINE3(echodev, , read, return, "struct echodev_softc *",
+    "ssize_t", "int");
+SDT_PROBE_DEFINE2(echodev, , write, entry, "struct echodev_softc *",
+    "ssize_t");
+SDT_PROBE_DEFINE3(echodev, , write, return, "struct echodev_softc *",
+    "ssize_t", "int");
+SDT_PROBE_DEFINE3(echodev, , ioctl, entry, "struct echodev_softc *",
+    "u_long", "int");
+SDT_PROBE_DEFINE3(echodev, , ioctl, return, "struct echodev_softc *",
+    "u_long", "int");
+SDT_PROBE_DEFINE3(echodev, , sleep, entry, "struct echodev_softc *",
+    "const char *", "size_t");
+SDT_PROBE_DEFINE4(echodev, , sleep, return, "struct echodev_softc *",
+    "const char *", "int", "size_t");
+SDT_PROBE_DEFINE2(echodev, , , wakeup, "struct echodev_softc *", "size_t");
+SDT_PROBE_DEFINE2(echodev, , notify, read, "struct echodev_softc *",
+    "size_t");
+SDT_PROBE_DEFINE2(echodev, , notify, write, "struct echodev_softc *",
+    "size_t");
+SDT_PROBE_DEFINE3(echodev, , , resize, "struct echodev_softc *", "size_t",
+    "size_t");
+SDT_PROBE_DEFINE2(echodev, , , clear, "struct echodev_softc *", "size_t");
+
+static bool echo_direct = true;
+SYSCTL_BOOL(_hw_echo, OID_AUTO, direct, CTLFLAG_RWTUN, &echo_direct, 0,
+    "Copy large writes directly to waiting readers");
+
+static bool echo_latency = true;
+SYSCTL_BOOL(_hw_echo, OID_AUTO, latency, CTLFLAG_RWTUN, &echo_latency, 0,
+    "Record latency histograms");
+
+static bool echo_tracing;
+SYSCTL_BOOL(_hw_echo, OID_AUTO, trace, CTLFLAG_RWTUN, &echo_tracing, 0,
+    "Record events in the trace rings");
+
+static uint64_t echo_trace_freq;
+SYSCTL_U64(_hw_echo, OID_AUTO, trace_freq, CTLFLAG_RD, &echo_trace_freq, 0,
+    "Frequency of trace event timestamps");
+
+static struct echo_trace_ring *echo_trace_rings;
+static struct cdev *echo_trace_dev;
+static bool echo_trace_dying;
+
+/* Serializes readers of the trace rings. */
+static struct sx echo_trace_lock;
+SX_SYSINIT(echo_trace, &echo_trace_lock, "echo trace");
+
+static int echo_status_interval = 100;
+SYSCTL_INT(_hw_echo, OID_AUTO, status_interval, CTLFLAG_RWTUN,
+    &echo_status_interval, 0,
+    "Milliseconds between statistics updates in status pages");
+
+static bool echo_lock_profiling;
+SYSCTL_BOOL(_hw_echo, OID_AUTO, lock_profiling, CTLFLAG_RWTUN,
+    &echo_lock_profiling, 0, "Profile instance lock contention");
+
+static struct echodev_softc **echo_softcs;
+
+/*
+ * Number of open AIO descriptors.  These block module unload, and no
+ * more are created once echo_aio_dying is set.
+ */
+static struct mtx echo_aio_mtx;
+MTX_SYSINIT(echo_aio, &echo_aio_mtx, "echo aio", MTX_DEF);
+static u_int echo_aio_files;
+static bool echo_aio_dying;
+
+/* Serializes changes to the O_ASYNC state of descriptors. */
+static struct sx echo_async_lock;
+SX_SYSINIT(echo_async, &echo_async_lock, "echo async");
+
+/*
+ * Serializes changes to links between instances.  No links are added
+ * once echo_links_dying is set during unload.
+ */
+static struct sx echo_links_lock;
+SX_SYSINIT(echo_links, &echo_links_lock, "echo links");
+static bool echo_links_dying;
+
 static d_open_t echo_open;
 static d_close_t echo_close;
 static d_read_t echo_read;
@@ -40,10 +461,17 @@ static d_write_t echo_write;
 static d_ioctl_t echo_ioctl;
 static d_poll_t echo_poll;
 static d_kqfilter_t echo_kqfilter;
+static d_mmap_single_t echo_mmap_single;
+static d_read_t echo_trace_read;
 static void	echo_kqread_detach(struct knote *);
 static int	echo_kqread_event(struct knote *, long);
 static void	echo_kqwrite_detach(struct knote *);
 static int	echo_kqwrite_event(struct knote *, long);
+static void	echo_kqagg_detach(struct knote *);
+static int	echo_kqagg_event(struct knote *, long);
+static struct echodev_softc *echodev_alloc(int, size_t);
+static void	echodev_free(struct echodev_softc *);
+static aio_handle_fn_t echo_aio_process;
 
 static struct filterops echo_read_filterops = {
 	.f_isfd =	1,
@@ -57,6 +485,12 @@ static struct filterops echo_write_filterops = {
 	.f_event =	echo_kqwrite_event
 };
 
+static struct filterops echo_agg_filterops = {
+	.f_isfd =	1,
+	.f_detach =	echo_kqagg_detach,
+	.f_event =	echo_kqagg_event
+};
+
 static struct cdevsw echo_cdevsw = {
 	.d_version =	D_VERSION,
 	.d_open =	echo_open,
@@ -66,195 +500,2967 @@ static struct cdevsw echo_cdevsw = {
 	.d_ioctl =	echo_ioctl,
 	.d_poll =	echo_poll,
 	.d_kqfilter =	echo_kqfilter,
+	.d_mmap_single = echo_mmap_single,
 	.d_flags =	D_TRACKCLOSE,
 	.d_name =	"echo"
 };
 
+static struct cdevsw echo_trace_cdevsw = {
+	.d_version =	D_VERSION,
+	.d_read =	echo_trace_read,
+	.d_name =	"echotrace"
+};
+
+/*
+ * Returns the number of bytes in a shared ring.  The indices are
+ * owned by user processes, so clamp the result to the ring size.
+ */
+static size_t
+echo_ring_used(struct echodev_ringbuf *ring)
+{
+	uint64_t head, tail;
+
+	tail = atomic_load_acq_64(&ring->hdr->er_tail);
+	head = atomic_load_acq_64(&ring->hdr->er_head);
+	return (MIN(head - tail, ring->size));
+}
+
+/*
+ * Request a wakeup from the other side of a shared ring.  Callers
+ * must recheck the ring state after setting the flags to avoid
+ * missing an update that raced with setting the flags.
+ */
+static void
+echo_ring_arm(struct echodev_ringbuf *ring, uint32_t flags)
+{
+	atomic_set_32(&ring->hdr->er_flags, flags);
+	atomic_thread_fence_seq_cst();
+}
+
+/*
+ * Returns true if data is exchanged via mapped memory rather than
+ * read(2) and write(2).
+ */
+static bool
+echo_mapped(struct echodev_softc *sc)
+{
+	return (sc->ring != NULL || sc->blocks != NULL);
+}
+
+/*
+ * Returns true if byte-mode data is buffered or in flight.  Modes
+ * cannot be changed while it is since readers in the new mode would
+ * never see it.
+ */
+static bool
+echo_bytes_pending(struct echodev_softc *sc)
+{
+	return (sc->valid != 0 || sc->reserved != 0 || sc->direct_active ||
+	    sc->splice_busy);
+}
+
+/*
+ * Returns the number of bytes available to read, the number of
+ * filled buffers in block mode, or the number of records in record
+ * mode.
+ */
+static size_t
+echo_valid(struct echodev_softc *sc)
+{
+	sx_assert(&sc->lock, SA_LOCKED);
+	if (sc->ring != NULL)
+		return (echo_ring_used(sc->ring));
+	if (sc->blocks != NULL)
+		return (sc->blocks->filled_count);
+	if (sc->record_mode)
+		return (sc->nrecords);
+	return (sc->valid + sc->direct_len);
+}
+
+/*
+ * Returns the number of bytes writers may append to the buffer, or
+ * the number of free buffers in block mode.  While a shrink is
+ * pending, writers are held to the new length so that readers can
+ * drain the buffer below it.  There is no space while a direct write
+ * is active since later data must not pass it.
+ */
+static size_t
+echo_space(struct echodev_softc *sc)
+{
+	size_t len;
+
+	sx_assert(&sc->lock, SA_LOCKED);
+	if (sc->ring != NULL)
+		return (sc->ring->size - echo_ring_used(sc->ring));
+	if (sc->blocks != NULL)
+		return (sc->blocks->free_count);
+	if (sc->record_mode) {
+		if (sc->nrecords == ECHO_RECORDS_MAX ||
+		    sc->record_bytes >= sc->len)
+			return (0);
+		return (sc->len - sc->record_bytes);
+	}
+	if (sc->direct_active)
+		return (0);
+	len = sc->len;
+	if (sc->resizing && sc->resize_len < len)
+		len = sc->resize_len;
+	if (sc->valid + sc->reserved >= len)
+		return (0);
+	return (len - sc->valid - sc->reserved);
+}
+
+/*
+ * Event tracing.  When hw.echo.trace is set, events are recorded in a
+ * ring for each CPU and can be read from /dev/echotrace.  Each ring
+ * has a single reader and old events are overwritten when a ring
+ * fills.
+ */
+static void
+echo_trace_record(struct echodev_softc *sc, int type, size_t arg)
+{
+	struct echo_trace_ring *tr;
+	struct echodev_trace_event *ev;
+	u_int head;
+
+	critical_enter();
+	tr = &echo_trace_rings[curcpu];
+	head = tr->head;
+	ev = &tr->ev[head % ECHO_TRACE_ENTRIES];
+	ev->ete_time = cpu_ticks();
+	ev->ete_arg = arg;
+	ev->ete_unit = sc->unit;
+	ev->ete_type = type;
+	ev->ete_cpu = curcpu;
+	atomic_store_rel_int(&tr->head, head + 1);
+	critical_exit();
+}
+
+/* The arguments are only evaluated when tracing is enabled. */
+#define	echo_trace(sc, type, arg) do {					\
+	if (__predict_false(echo_tracing))				\
+		echo_trace_record((sc), (type), (arg));			\
+} while (0)
+
+static void
+echo_count(struct echodev_softc *sc, enum echodev_stat stat, uint64_t n)
+{
+	counter_u64_add(sc->stats[stat], n);
+}
+
+/*
+ * Latency histograms use log-linear buckets: four linear buckets for
+ * each power of two nanoseconds.  See ECHODEV_HIST_MIN().
+ */
+static u_int
+echo_hist_bucket(uint64_t ns)
+{
+	u_int b, log2;
+
+	if (ns < 4)
+		return (ns);
+	log2 = flsll(ns) - 1;
+	b = (log2 - 1) * 4 + ((ns >> (log2 - 2)) & 3);
+	return (MIN(b, ECHODEV_HIST_BUCKETS - 1));
+}
+
+static void
+echo_hist_add(struct echodev_softc *sc, int which, sbintime_t start)
+{
+	uint64_t ns;
+
+	ns = sbttons(sbinuptime() - start);
+	counter_u64_add(sc->hist[which][echo_hist_bucket(ns)], 1);
+}
+
+/*
+ * Lock an instance on behalf of a class of caller.  When profiling is
+ * enabled, acquisitions that cannot take the lock immediately are
+ * counted as contended along with the time spent waiting.
+ */
+static sbintime_t
+echo_lock_wait(struct echodev_softc *sc, enum echodev_lock_site site,
+    bool exclusive)
+{
+	struct echodev_lockprof *lp = &sc->lockprof[site];
+	sbintime_t start;
+
+	counter_u64_add(lp->acquires, 1);
+	if (exclusive ? sx_try_xlock(&sc->lock) : sx_try_slock(&sc->lock))
+		return (sbinuptime());
+
+	start = sbinuptime();
+	if (exclusive)
+		sx_xlock(&sc->lock);
+	else
+		sx_slock(&sc->lock);
+	counter_u64_add(lp->contended, 1);
+	counter_u64_add(lp->wait_ns, sbttons(sbinuptime() - start));
+	return (sbinuptime());
+}
+
+static void
+echo_xlock(struct echodev_softc *sc, enum echodev_lock_site site)
+{
+	if (!echo_lock_profiling) {
+		sx_xlock(&sc->lock);
+		return;
+	}
+	sc->lock_time = echo_lock_wait(sc, site, true);
+	sc->lock_site = site;
+}
+
+static void
+echo_slock(struct echodev_softc *sc, enum echodev_lock_site site)
+{
+	if (!echo_lock_profiling) {
+		sx_slock(&sc->lock);
+		return;
+	}
+	(void)echo_lock_wait(sc, site, false);
+}
+
+/* Account for the end of an exclusive hold. */
+static void
+echo_lock_release(struct echodev_softc *sc)
+{
+	struct echodev_lockprof *lp;
+	uint64_t ns;
+
+	if (sc->lock_time == 0)
+		return;
+	lp = &sc->lockprof[sc->lock_site];
+	ns = sbttons(sbinuptime() - sc->lock_time);
+	if (ns > lp->max_hold_ns)
+		lp->max_hold_ns = ns;
+	sc->lock_time = 0;
+}
+
+static void
+echo_xunlock(struct echodev_softc *sc)
+{
+	echo_lock_release(sc);
+	sx_xunlock(&sc->lock);
+}
+
+static void
+echo_wakeup(struct echodev_softc *sc)
+{
+	struct echodev_sleeper *sl;
+	sbintime_t now;
+
+	echo_count(sc, ES_WAKEUPS, 1);
+	SDT_PROBE2(echodev, , , wakeup, sc, echo_valid(sc));
+	echo_trace(sc, ECHODEV_TRACE_WAKEUP, echo_valid(sc));
+
+	/* Note the first wakeup seen by each sleeping thread. */
+	if (!LIST_EMPTY(&sc->sleepers)) {
+		now = sbinuptime();
+		LIST_FOREACH(sl, &sc->sleepers, link) {
+			if (sl->woken == 0)
+				sl->woken = now;
+		}
+	}
+	wakeup(sc);
+}
+
+/* Sleep on an instance with its lock held exclusively. */
 static int
-echo_open(struct cdev *dev, int fflag, int devtype, struct thread *td)
+echo_sx_sleep(struct echodev_softc *sc, const char *wmesg)
 {
-	struct echodev_softc *sc = dev->si_drv1;
+	struct echodev_sleeper sl;
+	sbintime_t start;
+	int error, site;
+
+	/* The lock is not held while asleep. */
+	site = sc->lock_time != 0 ? sc->lock_site : -1;
+	echo_lock_release(sc);
+
+	SDT_PROBE3(echodev, , sleep, entry, sc, wmesg, echo_valid(sc));
+	echo_trace(sc, ECHODEV_TRACE_SLEEP, echo_valid(sc));
+	if (!echo_latency) {
+		error = sx_sleep(sc, &sc->lock, PCATCH, wmesg, 0);
+		SDT_PROBE4(echodev, , sleep, return, sc, wmesg, error,
+		    echo_valid(sc));
+		goto out;
+	}
+
+	sl.woken = 0;
+	LIST_INSERT_HEAD(&sc->sleepers, &sl, link);
+	start = sbinuptime();
+	error = sx_sleep(sc, &sc->lock, PCATCH, wmesg, 0);
+	LIST_REMOVE(&sl, link);
+	echo_hist_add(sc, ECHODEV_HIST_SLEEP, start);
+	if (sl.woken != 0)
+		echo_hist_add(sc, ECHODEV_HIST_WAKEUP, sl.woken);
+	SDT_PROBE4(echodev, , sleep, return, sc, wmesg, error, echo_valid(sc));
+out:
+	if (site != -1) {
+		sc->lock_time = sbinuptime();
+		sc->lock_site = site;
+	}
+	return (error);
+}
+
+/* Sleep waiting for data to read or for space to write. */
+static int
+echo_sleep(struct echodev_softc *sc, bool read, const char *wmesg)
+{
+	echo_count(sc, read ? ES_READ_SLEEPS : ES_WRITE_SLEEPS, 1);
+	return (echo_sx_sleep(sc, wmesg));
+}
+
+/*
+ * Hand queued AIO requests to AIO daemons now that they may be able
+ * to complete.  Requests that still cannot complete are requeued.
+ */
+static void
+echo_aio_run(struct echodev_softc *sc, bool read)
+{
+	struct kaiocb *job;
+
+	while ((job = TAILQ_FIRST(read ? &sc->aio_rjobs : &sc->aio_wjobs)) !=
+	    NULL) {
+		TAILQ_REMOVE(read ? &sc->aio_rjobs : &sc->aio_wjobs, job,
+		    list);
+		if (!aio_clear_cancel_function(job))
+			continue;
+		aio_schedule(job, echo_aio_process);
+	}
+}
+
+/* Queue a subscription on its aggregator's ready list. */
+static void
+echo_agg_ready(struct echodev_sub *sub)
+{
+	struct echodev_agg *agg = sub->agg;
+
+	mtx_lock(&agg->mtx);
+	if (!sub->ready) {
+		sub->ready = true;
+		TAILQ_INSERT_TAIL(&agg->ready, sub, ready_link);
+		agg->nready++;
+		if (agg->nready == 1) {
+			wakeup(agg);
+			selwakeup(&agg->sel);
+		}
+		KNOTE_LOCKED(&agg->sel.si_note, 0);
+	}
+	mtx_unlock(&agg->mtx);
+}
+
+/*
+ * Requeue aggregator subscriptions, AIO reads and the forwarding link
+ * for an instance that still has data once a splice or forward
+ * finishes.
+ */
+static void
+echo_subs_ready(struct echodev_softc *sc)
+{
+	struct echodev_sub *sub;
+
+	if (sc->valid == 0)
+		return;
+	TAILQ_FOREACH(sub, &sc->subs, sc_link)
+		echo_agg_ready(sub);
+	echo_aio_run(sc, true);
+	if (sc->out_link != NULL)
+		taskqueue_enqueue(taskqueue_thread, &sc->out_link->task);
+}
+
+/* Charge the time since the last occupancy change. */
+static void
+echo_occ_charge(struct echodev_softc *sc, sbintime_t now)
+{
+	struct echodev_occ *occ = &sc->occ;
+	uint64_t ns;
+
+	ns = sbttons(now - occ->last_time);
+	occ->time[MIN(fls(occ->last_valid), ECHODEV_OCC_BUCKETS - 1)] += ns;
+	if (occ->last_valid == 0)
+		occ->empty_ns += ns;
+	else if (occ->last_valid >= sc->len)
+		occ->full_ns += ns;
+	occ->last_time = now;
+}
+
+/* Update occupancy tracking after the buffer contents change. */
+static void
+echo_occ_update(struct echodev_softc *sc)
+{
+	struct echodev_occ *occ = &sc->occ;
+	sbintime_t now;
+	uint64_t age;
+	u_int i;
+
+	if (sc->valid == occ->last_valid)
+		return;
+
+	now = sbinuptime();
+	echo_occ_charge(sc, now);
+	if (sc->valid > occ->last_valid) {
+		occ->written += sc->valid - occ->last_valid;
+		if (occ->mark_count == ECHO_OCC_MARKS) {
+			/* Merge into the newest mark. */
+			i = (occ->mark_head + occ->mark_count - 1) %
+			    ECHO_OCC_MARKS;
+		} else {
+			i = (occ->mark_head + occ->mark_count) % ECHO_OCC_MARKS;
+			occ->marks[i].time = now;
+			occ->mark_count++;
+		}
+		occ->marks[i].end = occ->written;
+		if (sc->valid > occ->hwm)
+			occ->hwm = sc->valid;
+	} else {
+		occ->read += occ->last_valid - sc->valid;
+		while (occ->mark_count != 0 &&
+		    occ->marks[occ->mark_head].end <= occ->read) {
+			age = sbttons(now - occ->marks[occ->mark_head].time);
+			if (age > occ->max_age_ns)
+				occ->max_age_ns = age;
+			occ->mark_head = (occ->mark_head + 1) % ECHO_OCC_MARKS;
+			occ->mark_count--;
+		}
+	}
+	occ->last_valid = sc->valid;
+}
+
+/* Restart occupancy tracking, e.g. after a resize. */
+static void
+echo_occ_reset(struct echodev_softc *sc)
+{
+	struct echodev_occ *occ = &sc->occ;
+
+	memset(occ->time, 0, sizeof(occ->time));
+	occ->full_ns = 0;
+	occ->empty_ns = 0;
+	occ->max_age_ns = 0;
+	occ->hwm = sc->valid;
+	occ->last_time = sbinuptime();
+}
+
+static void
+echo_occupancy(struct echodev_softc *sc, struct echodev_occupancy *eo)
+{
+	struct echodev_occ *occ = &sc->occ;
+	sbintime_t now;
+	int i;
+
+	now = sbinuptime();
+	echo_occ_charge(sc, now);
+	memset(eo, 0, sizeof(*eo));
+	for (i = 0; i < ECHODEV_OCC_BUCKETS; i++) {
+		eo->eo_time[i] = occ->time[i];
+		eo->eo_total_ns += occ->time[i];
+	}
+	eo->eo_full_ns = occ->full_ns;
+	eo->eo_empty_ns = occ->empty_ns;
+	eo->eo_hwm = occ->hwm;
+	eo->eo_size = sc->len;
+	if (occ->mark_count != 0)
+		eo->eo_age_ns = sbttons(now - occ->marks[occ->mark_head].time);
+	eo->eo_max_age_ns = MAX(occ->max_age_ns, eo->eo_age_ns);
+}
+
+/*
+ * Status pages are updated with a sequence count that is odd while an
+ * update is in progress.  Only threads holding the instance lock
+ * exclusively update the page.
+ */
+static void
+echo_status_begin(struct echodev_status *st)
+{
+	atomic_store_32(&st->es_seq, st->es_seq + 1);
+	atomic_thread_fence_rel();
+}
+
+static void
+echo_status_end(struct echodev_status *st)
+{
+	atomic_store_rel_32(&st->es_seq, st->es_seq + 1);
+}
+
+/* Publish the current buffer state in the status page. */
+static void
+echo_status_update(struct echodev_softc *sc)
+{
+	struct echodev_status *st = sc->status;
+
+	if (st == NULL)
+		return;
+	echo_status_begin(st);
+	st->es_valid = echo_valid(sc);
+	st->es_len = sc->len;
+	st->es_space = echo_space(sc);
+	st->es_writers = sc->writers;
+	echo_status_end(st);
+}
+
+/*
+ * Notify pollers, knotes, links, and aggregators that data is
+ * available to read.
+ */
+static void
+echo_notify_read(struct echodev_softc *sc)
+{
+	struct echodev_file *ef;
+	struct echodev_sub *sub;
+
+	echo_occ_update(sc);
+	echo_status_update(sc);
+	SDT_PROBE2(echodev, , notify, read, sc, echo_valid(sc));
+	echo_trace(sc, ECHODEV_TRACE_NOTIFY_READ, echo_valid(sc));
+	selwakeup(&sc->rsel);
+	KNOTE_LOCKED(&sc->rsel.si_note, 0);
+	LIST_FOREACH(ef, &sc->rasync, rasync_link) {
+		if (ef->sigio != NULL)
+			pgsigio(&ef->sigio, SIGIO, 0);
+	}
+	if (sc->out_link != NULL)
+		taskqueue_enqueue(taskqueue_thread, &sc->out_link->task);
+	TAILQ_FOREACH(sub, &sc->subs, sc_link)
+		echo_agg_ready(sub);
+	echo_aio_run(sc, true);
+}
+
+/* Notify pollers, knotes, and links that space is available to write. */
+static void
+echo_notify_write(struct echodev_softc *sc)
+{
+	struct echodev_file *ef;
+	struct echodev_link *link;
+
+	echo_occ_update(sc);
+	echo_status_update(sc);
+	SDT_PROBE2(echodev, , notify, write, sc, echo_space(sc));
+	echo_trace(sc, ECHODEV_TRACE_NOTIFY_WRITE, echo_space(sc));
+	selwakeup(&sc->wsel);
+	KNOTE_LOCKED(&sc->wsel.si_note, 0);
+	LIST_FOREACH(ef, &sc->wasync, wasync_link) {
+		if (ef->sigio != NULL)
+			pgsigio(&ef->sigio, SIGIO, 0);
+	}
+	TAILQ_FOREACH(link, &sc->in_links, dst_link)
+		taskqueue_enqueue(taskqueue_thread, &link->task);
+	if (!STAILQ_EMPTY(&sc->kpi_bufs))
+		taskqueue_enqueue(taskqueue_thread, &sc->kpi_task);
+	echo_aio_run(sc, false);
+}
+
+static void
+echo_unsubscribe_one(struct echodev_sub *sub)
+{
+	struct echodev_agg *agg = sub->agg;
+	struct echodev_softc *sc = sub->sc;
+
+	echo_xlock(sc, LS_IOCTL);
+	TAILQ_REMOVE(&sc->subs, sub, sc_link);
+	mtx_lock(&agg->mtx);
+	TAILQ_REMOVE(&agg->subs, sub, agg_link);
+	if (sub->ready) {
+		TAILQ_REMOVE(&agg->ready, sub, ready_link);
+		agg->nready--;
+	}
+	mtx_unlock(&agg->mtx);
+	echo_xunlock(sc);
+	free(sub, M_ECHODEV);
+}
+
+static void
+echo_agg_free(struct echodev_agg *agg)
+{
+	struct echodev_sub *sub;
+
+	/*
+	 * Subscriptions are only added or removed by ioctls on the
+	 * aggregator's own descriptor, which cannot race with close.
+	 */
+	while ((sub = TAILQ_FIRST(&agg->subs)) != NULL)
+		echo_unsubscribe_one(sub);
+	knlist_destroy(&agg->sel.si_note);
+	seldrain(&agg->sel);
+	mtx_destroy(&agg->mtx);
+	sx_destroy(&agg->sublock);
+	free(agg, M_ECHODEV);
+}
+
+static int
+echo_add_writer(struct echodev_softc *sc)
+{
+	echo_xlock(sc, LS_IOCTL);
+	if (sc->writers == UINT_MAX) {
+		echo_xunlock(sc);
+		return (EBUSY);
+	}
+	sc->writers++;
+	echo_status_update(sc);
+	echo_xunlock(sc);
+	return (0);
+}
+
+static void
+echo_drop_writer(struct echodev_softc *sc)
+{
+	echo_xlock(sc, LS_IOCTL);
+	sc->writers--;
+	echo_status_update(sc);
+	if (sc->writers == 0) {
+		/* Wakeup any waiting readers. */
+		echo_wakeup(sc);
+		echo_notify_read(sc);
+	}
+	echo_xunlock(sc);
+}
+
+/*
+ * Signal-driven I/O.  Each descriptor with O_ASYNC set is sent SIGIO
+ * when data arrives on the instance it reads and when space is freed
+ * on the instance it writes.  For a paired descriptor these are
+ * different instances.
+ */
+static void
+echo_set_async(struct echodev_file *ef, bool on)
+{
+	sx_xlock(&echo_async_lock);
+	if (ef->async == on) {
+		sx_xunlock(&echo_async_lock);
+		return;
+	}
+	echo_xlock(ef->rsc, LS_IOCTL);
+	if (on)
+		LIST_INSERT_HEAD(&ef->rsc->rasync, ef, rasync_link);
+	else
+		LIST_REMOVE(ef, rasync_link);
+	echo_xunlock(ef->rsc);
+	echo_xlock(ef->wsc, LS_IOCTL);
+	if (on)
+		LIST_INSERT_HEAD(&ef->wsc->wasync, ef, wasync_link);
+	else
+		LIST_REMOVE(ef, wasync_link);
+	echo_xunlock(ef->wsc);
+	ef->async = on;
+	sx_xunlock(&echo_async_lock);
+}
+
+static void
+echo_file_dtor(void *arg)
+{
+	struct echodev_file *ef = arg;
+
+	if (ef->agg != NULL)
+		echo_agg_free(ef->agg);
+	echo_set_async(ef, false);
+	funsetown(&ef->sigio);
+	free(ef, M_ECHODEV);
+}
+
+static int
+echo_open(struct cdev *dev, int fflag, int devtype, struct thread *td)
+{
+	struct echodev_softc *sc = dev->si_drv1;
+	struct echodev_file *ef;
+	int error;
+
+	if ((fflag & FWRITE) != 0) {
+		/* Increase the number of writers. */
+		error = echo_add_writer(sc);
+		if (error != 0)
+			return (error);
+	}
+
+	ef = malloc(sizeof(*ef), M_ECHODEV, M_WAITOK | M_ZERO);
+	ef->rsc = sc;
+	ef->wsc = sc;
+	ef->fflag = fflag;
+	error = devfs_set_cdevpriv(ef, echo_file_dtor);
+	if (error != 0) {
+		free(ef, M_ECHODEV);
+		if ((fflag & FWRITE) != 0)
+			echo_drop_writer(sc);
+	}
+	return (error);
+}
+
+static int
+echo_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
+{
+	struct echodev_file *ef;
+	int error;
+
+	error = devfs_get_cdevpriv((void **)&ef);
+	if (error != 0)
+		return (error);
+	if ((fflag & FWRITE) != 0)
+		echo_drop_writer(ef->wsc);
+	if (ef->rsc->peer != NULL && ef->rsc->peer == ef->wsc) {
+		/* Endpoint 1 of a pair. */
+		echo_xlock(ef->rsc, LS_IOCTL);
+		ef->rsc->pair1_open--;
+		echo_xunlock(ef->rsc);
+	}
+	return (0);
+}
+
+/*
+ * Wait for room to queue a record holding len bytes of inline data.
+ * Reference records only consume a queue slot.
+ */
+static int
+echo_record_wait(struct echodev_softc *sc, size_t len, int ioflag)
+{
+	int error;
+
+	for (;;) {
+		if (sc->dying)
+			return (ENXIO);
+		if (!sc->record_mode)
+			return (EINVAL);
+		if (len > sc->len)
+			return (EMSGSIZE);
+		if (sc->nrecords < ECHO_RECORDS_MAX &&
+		    sc->record_bytes + len <= sc->len)
+			return (0);
+		if (ioflag & O_NONBLOCK)
+			return (EWOULDBLOCK);
+		error = echo_sleep(sc, false, "echorw");
+		if (error != 0)
+			return (error);
+	}
+}
+
+static void
+echo_record_enqueue(struct echodev_softc *sc, struct echodev_record *rec)
+{
+	/* Wakeup any waiting readers. */
+	if (sc->nrecords == 0)
+		echo_wakeup(sc);
+
+	STAILQ_INSERT_TAIL(&sc->records, rec, link);
+	sc->nrecords++;
+	if (rec->fp == NULL)
+		sc->record_bytes += rec->len;
+	echo_notify_read(sc);
+}
+
+/* Wait for a record to read.  Returns NULL with no error at EOF. */
+static int
+echo_record_peek(struct echodev_softc *sc, int ioflag,
+    struct echodev_record **recp)
+{
+	int error;
+
+	while (sc->nrecords == 0 && sc->writers != 0) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (!sc->record_mode)
+			error = EINVAL;
+		else if (ioflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else
+			error = echo_sleep(sc, true, "echorr");
+		if (error != 0)
+			return (error);
+	}
+	*recp = STAILQ_FIRST(&sc->records);
+	return (0);
+}
+
+static void
+echo_record_dequeue(struct echodev_softc *sc, struct echodev_record *rec)
+{
+	/* Wakeup any waiting writers. */
+	if (echo_space(sc) == 0)
+		echo_wakeup(sc);
+
+	STAILQ_REMOVE_HEAD(&sc->records, link);
+	sc->nrecords--;
+	if (rec->fp == NULL)
+		sc->record_bytes -= rec->len;
+	echo_notify_write(sc);
+}
+
+static void
+echo_record_free(struct echodev_record *rec)
+{
+	if (rec->fp != NULL)
+		fdrop(rec->fp, curthread);
+	free(rec, M_ECHODEV);
+}
+
+/*
+ * Remove all queued records, dropping any unconsumed references.
+ * The records are freed after the lock is released.
+ */
+static void
+echo_records_flush(struct echodev_softc *sc, struct echodev_records *list)
+{
+	sx_assert(&sc->lock, SA_XLOCKED);
+	if (sc->nrecords == 0)
+		return;
+
+	/* Wakeup any waiting writers. */
+	if (echo_space(sc) == 0)
+		echo_wakeup(sc);
+
+	STAILQ_CONCAT(list, &sc->records);
+	sc->nrecords = 0;
+	sc->record_bytes = 0;
+	echo_notify_write(sc);
+}
+
+static void
+echo_records_free(struct echodev_records *list)
+{
+	struct echodev_record *rec, *next;
+
+	STAILQ_FOREACH_SAFE(rec, list, link, next)
+		echo_record_free(rec);
+}
+
+/*
+ * Read the next inline record.  Data beyond the caller's buffer is
+ * discarded.  References must be received via ECHODEV_RECV.
+ */
+static int
+echo_read_record(struct echodev_softc *sc, struct uio *uio, int ioflag)
+{
+	struct echodev_record *rec;
+	int error;
+
+	error = echo_record_peek(sc, ioflag, &rec);
+	if (error != 0 || rec == NULL)
+		return (error);
+	if (rec->fp != NULL)
+		return (EBADMSG);
+
+	error = uiomove(rec->data, MIN(uio->uio_resid, rec->len), uio);
+	if (error != 0)
+		return (error);
+	echo_record_dequeue(sc, rec);
+	free(rec, M_ECHODEV);
+	return (0);
+}
+
+/* Queue each write as a single inline record. */
+static int
+echo_write_record(struct echodev_softc *sc, struct uio *uio, int ioflag)
+{
+	struct echodev_record *rec;
+	size_t len;
+	int error;
+
+	len = uio->uio_resid;
+	if (len > sc->len)
+		return (EMSGSIZE);
+
+	/* Allocate the record without holding the lock. */
+	echo_xunlock(sc);
+	rec = malloc(sizeof(*rec) + len, M_ECHODEV, M_WAITOK);
+	rec->fp = NULL;
+	rec->offset = 0;
+	rec->len = len;
+	echo_xlock(sc, LS_WRITE);
+
+	error = echo_record_wait(sc, len, ioflag);
+	if (error == 0)
+		error = uiomove(rec->data, len, uio);
+	if (error != 0) {
+		free(rec, M_ECHODEV);
+		return (error);
+	}
+	echo_record_enqueue(sc, rec);
+	return (0);
+}
+
+/* Queue a reference to a region of a shared memory object. */
+static int
+echo_send_ref(struct echodev_softc *sc, const struct echodev_ref *ref,
+    int fflag, struct thread *td)
+{
+	struct echodev_record *rec;
+	struct file *fp;
+	int error;
+
+	if (ref->er_offset < 0 || ref->er_len == 0 ||
+	    ref->er_len > OFF_MAX - ref->er_offset)
+		return (EINVAL);
+
+	error = fget(td, ref->er_fd, &cap_mmap_rights, &fp);
+	if (error != 0)
+		return (error);
+	if (fp->f_type != DTYPE_SHM) {
+		fdrop(fp, td);
+		return (EINVAL);
+	}
+
+	rec = malloc(sizeof(*rec), M_ECHODEV, M_WAITOK);
+	rec->fp = fp;
+	rec->offset = ref->er_offset;
+	rec->len = ref->er_len;
+
+	echo_xlock(sc, LS_IOCTL);
+	error = echo_record_wait(sc, 0, fflag);
+	if (error == 0)
+		echo_record_enqueue(sc, rec);
+	echo_xunlock(sc);
+	if (error != 0)
+		echo_record_free(rec);
+	return (error);
+}
+
+/*
+ * Receive the next record.  Inline data is copied to the caller's
+ * buffer.  References are installed as a new file descriptor.
+ */
+static int
+echo_recv(struct echodev_softc *sc, struct echodev_recv *er, int fflag,
+    struct thread *td)
+{
+	struct echodev_record *rec;
+	int error, fd;
+
+	echo_xlock(sc, LS_IOCTL);
+	error = echo_record_peek(sc, fflag, &rec);
+	if (error != 0 || rec == NULL) {
+		echo_xunlock(sc);
+		er->er_len = 0;
+		er->er_fd = -1;
+		er->er_offset = 0;
+		return (error);
+	}
+
+	if (rec->fp != NULL) {
+		error = finstall(td, rec->fp, &fd, O_CLOEXEC, NULL);
+		if (error == 0) {
+			er->er_fd = fd;
+			er->er_offset = rec->offset;
+		}
+	} else {
+		error = copyout(rec->data, er->er_buf,
+		    MIN(er->er_buflen, rec->len));
+		if (error == 0) {
+			er->er_fd = -1;
+			er->er_offset = 0;
+		}
+	}
+	if (error != 0) {
+		echo_xunlock(sc);
+		return (error);
+	}
+	er->er_len = rec->len;
+	echo_record_dequeue(sc, rec);
+	echo_xunlock(sc);
+	echo_record_free(rec);
+	return (0);
+}
+
+/* Enable or disable record mode. */
+static int
+echo_set_records(struct echodev_softc *sc, bool enable)
+{
+	struct echodev_records list;
+
+	STAILQ_INIT(&list);
+	echo_xlock(sc, LS_IOCTL);
+	if (enable && (echo_mapped(sc) || echo_bytes_pending(sc))) {
+		echo_xunlock(sc);
+		return (EBUSY);
+	}
+	if (!enable)
+		echo_records_flush(sc, &list);
+	sc->record_mode = enable;
+
+	/* Force any sleeping threads to reevaluate the mode. */
+	echo_wakeup(sc);
+	echo_notify_read(sc);
+	echo_notify_write(sc);
+	echo_xunlock(sc);
+
+	echo_records_free(&list);
+	return (0);
+}
+
+/* Remove bytes from the head of the buffer. */
+static void
+echo_consume(struct echodev_softc *sc, size_t todo)
+{
+	/* Wakeup any waiting writers or pending resize. */
+	if (echo_space(sc) == 0 || sc->resizing)
+		echo_wakeup(sc);
+
+	sc->valid -= todo;
+	memmove(sc->buf, sc->buf + todo, sc->valid);
+	echo_notify_write(sc);
+}
+
+/*
+ * Undo the copies made to a uio since it was cloned into saved.
+ */
+static void
+echo_uio_restore(struct uio *uio, struct uio *saved)
+{
+	struct iovec *iov;
+
+	iov = uio->uio_iov - (saved->uio_iovcnt - uio->uio_iovcnt);
+	memcpy(iov, saved->uio_iov, saved->uio_iovcnt * sizeof(*iov));
+	uio->uio_iov = iov;
+	uio->uio_iovcnt = saved->uio_iovcnt;
+	uio->uio_resid = saved->uio_resid;
+	uio->uio_offset = saved->uio_offset;
+}
+
+/*
+ * Read tagged data from the ready instances of an aggregator.  Each
+ * chunk is preceded by a struct echodev_agg_hdr.  Instances that
+ * still have data after a chunk is read move to the end of the ready
+ * list so that busy instances do not starve others.  Statistics for
+ * each chunk are charged to the instance it was read from.
+ */
+static int
+echo_read_agg(struct echodev_agg *agg, struct uio *uio, int ioflag)
+{
+	struct echodev_agg_hdr hdr;
+	struct echodev_softc *sc;
+	struct echodev_sub *sub;
+	struct uio *saved;
+	sbintime_t start;
+	size_t todo;
+	int error;
+	bool done;
+
+	if (uio->uio_resid <= sizeof(hdr))
+		return (EINVAL);
+
+	done = false;
+	error = 0;
+	while (uio->uio_resid > sizeof(hdr)) {
+		/*
+		 * Hold the subscription lock while using a dequeued
+		 * subscription so it cannot be freed, but not while
+		 * sleeping so that subscriptions can still change.
+		 */
+		sx_slock(&agg->sublock);
+		mtx_lock(&agg->mtx);
+		sub = TAILQ_FIRST(&agg->ready);
+		if (sub == NULL) {
+			sx_sunlock(&agg->sublock);
+			if (done)
+				error = EJUSTRETURN;
+			else if (ioflag & O_NONBLOCK)
+				error = EWOULDBLOCK;
+			else
+				error = mtx_sleep(agg, &agg->mtx, PCATCH,
+				    "echoag", 0);
+			mtx_unlock(&agg->mtx);
+			if (error != 0)
+				break;
+			continue;
+		}
+		TAILQ_REMOVE(&agg->ready, sub, ready_link);
+		sub->ready = false;
+		agg->nready--;
+		mtx_unlock(&agg->mtx);
+
+		sc = sub->sc;
+		start = echo_latency ? sbinuptime() : 0;
+		todo = 0;
+		echo_xlock(sc, LS_READ);
+		if (sc->valid != 0 && !sc->splice_busy && !echo_mapped(sc) &&
+		    !sc->record_mode) {
+			todo = MIN(uio->uio_resid - sizeof(hdr), sc->valid);
+			hdr.eah_unit = sc->unit;
+			hdr.eah_len = todo;
+
+			/*
+			 * The header and data are copied as a unit.  If
+			 * earlier chunks were returned, a failed copy is
+			 * undone so the read ends on a chunk boundary.
+			 */
+			saved = done ? cloneuio(uio) : NULL;
+			error = uiomove(&hdr, sizeof(hdr), uio);
+			if (error == 0)
+				error = uiomove(sc->buf, todo, uio);
+			if (error == 0) {
+				echo_consume(sc, todo);
+				done = true;
+			} else if (saved != NULL)
+				echo_uio_restore(uio, saved);
+			if (saved != NULL)
+				free(saved, M_IOV);
+		}
+		/*
+		 * A busy instance is requeued by echo_subs_ready() once
+		 * the splice or forward finishes.
+		 */
+		if (sc->valid != 0 && !sc->splice_busy)
+			echo_agg_ready(sub);
+		echo_xunlock(sc);
+		if (todo != 0) {
+			if (start != 0)
+				echo_hist_add(sc, ECHODEV_HIST_READ, start);
+			echo_trace(sc, ECHODEV_TRACE_READ, todo);
+			echo_count(sc, ES_READ_CALLS, 1);
+			echo_count(sc, ES_READ_BYTES, error == 0 ? todo : 0);
+		}
+		sx_sunlock(&agg->sublock);
+		if (error != 0)
+			break;
+	}
+	return (done ? 0 : error);
+}
+
+static int
+echo_read_data(struct echodev_file *ef, struct uio *uio, int ioflag)
+{
+	struct echodev_softc *sc;
+	size_t todo;
+	int error;
+
+	if (uio->uio_resid == 0)
+		return (0);
+
+	sc = ef->rsc;
+
+	echo_xlock(sc, LS_READ);
+	if (echo_mapped(sc)) {
+		echo_xunlock(sc);
+		return (EOPNOTSUPP);
+	}
+	if (sc->record_mode) {
+		error = echo_read_record(sc, uio, ioflag);
+		echo_xunlock(sc);
+		return (error);
+	}
+
+	/* Wait for bytes to read and for any splice to finish. */
+	while ((sc->valid == 0 && sc->direct_len == 0 && sc->writers != 0) ||
+	    sc->splice_busy) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (echo_mapped(sc))
+			error = EOPNOTSUPP;
+		else if (sc->record_mode)
+			error = EINVAL;
+		else if (ioflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else {
+			sc->rwaiters++;
+			error = echo_sleep(sc, true, "echord");
+			sc->rwaiters--;
+		}
+		if (error != 0) {
+			echo_xunlock(sc);
+			return (error);
+		}
+	}
+
+	/* Copy directly from a writer's pages. */
+	if (sc->direct_len != 0) {
+		todo = MIN(uio->uio_resid, sc->direct_len);
+		error = uiomove_fromphys(sc->direct_pages, sc->direct_off,
+		    todo, uio);
+		if (error == 0) {
+			sc->direct_off += todo;
+			sc->direct_len -= todo;
+
+			/* Wakeup the direct writer. */
+			if (sc->direct_len == 0)
+				echo_wakeup(sc);
+		}
+		echo_xunlock(sc);
+		return (error);
+	}
+
+	todo = MIN(uio->uio_resid, sc->valid);
+	error = uiomove(sc->buf, todo, uio);
+	if (error == 0)
+		echo_consume(sc, todo);
+	echo_xunlock(sc);
+	return (error);
+}
+
+/* Read from a descriptor and update statistics. */
+static int
+echo_read_file(struct echodev_file *ef, struct uio *uio, int ioflag)
+{
+	sbintime_t start;
+	ssize_t resid;
+	int error;
+
+	/* Aggregator reads are charged to the instances read from. */
+	if (ef->agg != NULL) {
+		if (uio->uio_resid == 0)
+			return (0);
+		return (echo_read_agg(ef->agg, uio, ioflag));
+	}
+
+	SDT_PROBE2(echodev, , read, entry, ef->rsc, uio->uio_resid);
+	start = echo_latency ? sbinuptime() : 0;
+	resid = uio->uio_resid;
+	error = echo_read_data(ef, uio, ioflag);
+	if (start != 0)
+		echo_hist_add(ef->rsc, ECHODEV_HIST_READ, start);
+	SDT_PROBE3(echodev, , read, return, ef->rsc, resid - uio->uio_resid,
+	    error);
+	echo_trace(ef->rsc, ECHODEV_TRACE_READ, resid - uio->uio_resid);
+	echo_count(ef->rsc, ES_READ_CALLS, 1);
+	echo_count(ef->rsc, ES_READ_BYTES, resid - uio->uio_resid);
+	if (error == EWOULDBLOCK)
+		echo_count(ef->rsc, ES_READ_WOULDBLOCK, 1);
+	return (error);
+}
+
+static int
+echo_read(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct echodev_file *ef;
+	int error;
+
+	error = devfs_get_cdevpriv((void **)&ef);
+	if (error != 0)
+		return (error);
+	return (echo_read_file(ef, uio, ioflag));
+}
+
+/*
+ * Returns the size of the next chunk of a write to pass directly to
+ * readers, or zero if the chunk should be copied into the buffer.
+ * Direct writes are only used when the buffer is empty so that data
+ * is not reordered.
+ */
+static size_t
+echo_direct_size(struct echodev_softc *sc, struct uio *uio, int ioflag)
+{
+	struct iovec *iov;
+
+	if (sc->valid != 0 || sc->direct_active || sc->resizing ||
+	    sc->splicers != 0 || sc->out_link != NULL ||
+	    !TAILQ_EMPTY(&sc->subs) ||
+	    (ioflag & O_NONBLOCK) != 0 ||
+	    uio->uio_segflg != UIO_USERSPACE)
+		return (0);
+
+	/* Without a waiting reader the writer could sleep forever. */
+	if (sc->rwaiters == 0)
+		return (0);
+
+	iov = uio->uio_iov;
+	if (sc->loan && ((vm_offset_t)iov->iov_base & PAGE_MASK) == 0 &&
+	    iov->iov_len >= PAGE_SIZE)
+		return (MIN(trunc_page(iov->iov_len), ECHO_LOAN_MAX));
+	if (echo_direct && iov->iov_len >= ECHO_DIRECT_MIN)
+		return (MIN(iov->iov_len, ECHO_DIRECT_MAX));
+	return (0);
+}
+
+/*
+ * Hold the pages backing the next chunk of a write and wait for
+ * readers to copy the data out of them.
+ */
+static int
+echo_direct_write(struct echodev_softc *sc, struct uio *uio, size_t size)
+{
+	struct iovec *iov;
+	vm_offset_t addr;
+	size_t done;
+	int error, n;
+
+	iov = uio->uio_iov;
+	addr = (vm_offset_t)iov->iov_base;
+
+	/* Block other writers while faulting in the pages. */
+	sc->direct_active = true;
+	echo_xunlock(sc);
+	n = vm_fault_quick_hold_pages(
+	    &uio->uio_td->td_proc->p_vmspace->vm_map, addr, size,
+	    VM_PROT_READ, sc->direct_pages, ECHO_DIRECT_NPAGES);
+	echo_xlock(sc, LS_WRITE);
+	if (n == -1) {
+		sc->direct_active = false;
+		echo_wakeup(sc);
+		return (EFAULT);
+	}
+
+	/* Wakeup any waiting readers. */
+	sc->direct_npages = n;
+	sc->direct_off = addr & PAGE_MASK;
+	sc->direct_len = size;
+	echo_wakeup(sc);
+	echo_notify_read(sc);
+
+	/* Wait for readers to consume the data. */
+	error = 0;
+	while (sc->direct_len != 0) {
+		if (sc->dying)
+			error = ENXIO;
+		else
+			error = echo_sleep(sc, false, "echodw");
+		if (error != 0)
+			break;
+	}
+
+	done = size - sc->direct_len;
+	sc->direct_len = 0;
+	sc->direct_active = false;
+	vm_page_unhold_pages(sc->direct_pages, sc->direct_npages);
+	sc->direct_npages = 0;
+
+	iov->iov_base = (char *)iov->iov_base + done;
+	iov->iov_len -= done;
+	uio->uio_resid -= done;
+	uio->uio_offset += done;
+
+	/* Wakeup any writers waiting for the direct write to finish. */
+	echo_wakeup(sc);
+	echo_notify_write(sc);
+	return (error);
+}
+
+static int
+echo_write_data(struct echodev_file *ef, struct uio *uio, int ioflag)
+{
+	struct echodev_softc *sc;
+	size_t todo;
+	int error;
+
+	if (uio->uio_resid == 0)
+		return (0);
+
+	sc = ef->wsc;
+
+	echo_xlock(sc, LS_WRITE);
+	if (echo_mapped(sc)) {
+		echo_xunlock(sc);
+		return (EOPNOTSUPP);
+	}
+	if (sc->record_mode) {
+		error = echo_write_record(sc, uio, ioflag);
+		echo_xunlock(sc);
+		return (error);
+	}
+	while (uio->uio_resid != 0) {
+		todo = echo_direct_size(sc, uio, ioflag);
+		if (todo != 0) {
+			error = echo_direct_write(sc, uio, todo);
+			if (error != 0) {
+				echo_xunlock(sc);
+				return (error);
+			}
+			continue;
+		}
+
+		/* Wait for space to write. */
+		while (echo_mapped(sc) || echo_space(sc) == 0) {
+			if (sc->dying)
+				error = ENXIO;
+			else if (echo_mapped(sc))
+				error = EOPNOTSUPP;
+			else if (sc->record_mode)
+				error = EINVAL;
+			else if (ioflag & O_NONBLOCK)
+				error = EWOULDBLOCK;
+			else
+				error = echo_sleep(sc, false, "echowr");
+			if (error != 0) {
+				echo_xunlock(sc);
+				return (error);
+			}
+		}
+
+		todo = MIN(uio->uio_resid, echo_space(sc));
+		error = uiomove(sc->buf + sc->valid, todo, uio);
+		if (error == 0) {
+			/* Wakeup any waiting readers. */
+			if (sc->valid == 0)
+				echo_wakeup(sc);
+
+			sc->valid += todo;
+			echo_notify_read(sc);
+		}
+	}
+	echo_xunlock(sc);
+	return (error);
+}
+
+/* Write to a descriptor and update statistics. */
+static int
+echo_write_file(struct echodev_file *ef, struct uio *uio, int ioflag)
+{
+	sbintime_t start;
+	ssize_t resid;
+	int error;
+
+	SDT_PROBE2(echodev, , write, entry, ef->wsc, uio->uio_resid);
+	start = echo_latency ? sbinuptime() : 0;
+	resid = uio->uio_resid;
+	error = echo_write_data(ef, uio, ioflag);
+	if (start != 0)
+		echo_hist_add(ef->wsc, ECHODEV_HIST_WRITE, start);
+	SDT_PROBE3(echodev, , write, return, ef->wsc, resid - uio->uio_resid,
+	    error);
+	echo_trace(ef->wsc, ECHODEV_TRACE_WRITE, resid - uio->uio_resid);
+	echo_count(ef->wsc, ES_WRITE_CALLS, 1);
+	echo_count(ef->wsc, ES_WRITE_BYTES, resid - uio->uio_resid);
+	if (error == EWOULDBLOCK)
+		echo_count(ef->wsc, ES_WRITE_WOULDBLOCK, 1);
+	return (error);
+}
+
+static int
+echo_write(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct echodev_file *ef;
+	int error;
+
+	error = devfs_get_cdevpriv((void **)&ef);
+	if (error != 0)
+		return (error);
+	return (echo_write_file(ef, uio, ioflag));
+}
+
+/*
+ * AIO descriptors.  aio_read(2) and aio_write(2) requests on a
+ * descriptor returned by ECHODEV_AIOFD are queued in the driver
+ * instead of blocking an AIO daemon.  A request is only handed to an
+ * AIO daemon once data or space is available, and completions are
+ * reported through the usual AIO notifications such as EVFILT_AIO.
+ */
+static fo_rdwr_t echo_aio_fo_read;
+static fo_rdwr_t echo_aio_fo_write;
+static fo_ioctl_t echo_aio_fo_ioctl;
+static fo_stat_t echo_aio_fo_stat;
+static fo_close_t echo_aio_fo_close;
+static fo_fill_kinfo_t echo_aio_fo_fill_kinfo;
+static fo_aio_queue_t echo_aio_queue;
+
+static struct fileops echo_aio_fileops = {
+	.fo_read = echo_aio_fo_read,
+	.fo_write = echo_aio_fo_write,
+	.fo_truncate = invfo_truncate,
+	.fo_ioctl = echo_aio_fo_ioctl,
+	.fo_poll = invfo_poll,
+	.fo_kqfilter = invfo_kqfilter,
+	.fo_stat = echo_aio_fo_stat,
+	.fo_close = echo_aio_fo_close,
+	.fo_chmod = invfo_chmod,
+	.fo_chown = invfo_chown,
+	.fo_sendfile = invfo_sendfile,
+	.fo_fill_kinfo = echo_aio_fo_fill_kinfo,
+	.fo_aio_queue = echo_aio_queue,
+	.fo_flags = DFLAG_PASSABLE
+};
+
+static bool
+echo_aio_is_read(struct kaiocb *job)
+{
+	return (job->uaiocb.aio_lio_opcode == LIO_READ);
+}
+
+static struct echodev_softc *
+echo_aio_softc(struct kaiocb *job)
+{
+	struct echodev_file *ef = job->fd_file->f_data;
+
+	return (echo_aio_is_read(job) ? ef->rsc : ef->wsc);
+}
+
+static void
+echo_aio_cancel(struct kaiocb *job)
+{
+	struct echodev_softc *sc = echo_aio_softc(job);
+
+	echo_xlock(sc, echo_aio_is_read(job) ? LS_READ : LS_WRITE);
+	if (!aio_cancel_cleared(job))
+		TAILQ_REMOVE(echo_aio_is_read(job) ? &sc->aio_rjobs :
+		    &sc->aio_wjobs, job, list);
+	echo_xunlock(sc);
+	aio_cancel(job);
+}
+
+/*
+ * Queue a request until it can make progress.  Requests that can
+ * already complete are scheduled immediately.
+ */
+static void
+echo_aio_enqueue(struct kaiocb *job)
+{
+	struct echodev_softc *sc = echo_aio_softc(job);
+	bool ready;
+
+	echo_xlock(sc, echo_aio_is_read(job) ? LS_READ : LS_WRITE);
+	if (sc->dying)
+		ready = true;
+	else if (echo_aio_is_read(job))
+		ready = echo_valid(sc) != 0 || sc->writers == 0;
+	else
+		ready = echo_space(sc) != 0;
+	if (ready) {
+		echo_xunlock(sc);
+		aio_schedule(job, echo_aio_process);
+		return;
+	}
+	if (!aio_set_cancel_function(job, echo_aio_cancel)) {
+		echo_xunlock(sc);
+		aio_cancel(job);
+		return;
+	}
+	TAILQ_INSERT_TAIL(echo_aio_is_read(job) ? &sc->aio_rjobs :
+	    &sc->aio_wjobs, job, list);
+	echo_xunlock(sc);
+}
+
+/*
+ * Complete a request from an AIO daemon.  The request is performed
+ * without blocking and is requeued if another request consumed the
+ * data or space first.
+ */
+static void
+echo_aio_process(struct kaiocb *job)
+{
+	struct echodev_file *ef = job->fd_file->f_data;
+	struct ucred *td_savedcred;
+	struct thread *td;
+	struct iovec aiov;
+	struct uio auio;
+	long done;
+	int error;
+
+	td = curthread;
+	td_savedcred = td->td_ucred;
+	td->td_ucred = job->cred;
+
+	aiov.iov_base = (void *)(uintptr_t)job->uaiocb.aio_buf;
+	aiov.iov_len = job->uaiocb.aio_nbytes;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = job->uaiocb.aio_nbytes;
+	auio.uio_segflg = UIO_USERSPACE;
+	auio.uio_td = td;
+	if (echo_aio_is_read(job)) {
+		auio.uio_rw = UIO_READ;
+		error = echo_read_file(ef, &auio, O_NONBLOCK);
+	} else {
+		auio.uio_rw = UIO_WRITE;
+		error = echo_write_file(ef, &auio, O_NONBLOCK);
+	}
+	td->td_ucred = td_savedcred;
+
+	done = job->uaiocb.aio_nbytes - auio.uio_resid;
+	if (error == EWOULDBLOCK) {
+		if (done == 0) {
+			echo_aio_enqueue(job);
+			return;
+		}
+		error = 0;
+	}
+	if (error != 0)
+		aio_complete(job, -1, error);
+	else
+		aio_complete(job, done, 0);
+}
+
+static int
+echo_aio_queue(struct file *fp, struct kaiocb *job)
+{
+	switch (job->uaiocb.aio_lio_opcode) {
+	case LIO_READ:
+	case LIO_WRITE:
+		echo_aio_enqueue(job);
+		return (0);
+	default:
+		return (aio_queue_file(fp, job));
+	}
+}
+
+static int
+echo_aio_fo_read(struct file *fp, struct uio *uio, struct ucred *active_cred,
+    int flags, struct thread *td)
+{
+	return (echo_read_file(fp->f_data, uio,
+	    (fp->f_flag & FNONBLOCK) != 0 ? O_NONBLOCK : 0));
+}
+
+static int
+echo_aio_fo_write(struct file *fp, struct uio *uio, struct ucred *active_cred,
+    int flags, struct thread *td)
+{
+	return (echo_write_file(fp->f_data, uio,
+	    (fp->f_flag & FNONBLOCK) != 0 ? O_NONBLOCK : 0));
+}
+
+static int
+echo_aio_fo_ioctl(struct file *fp, u_long cmd, void *data,
+    struct ucred *active_cred, struct thread *td)
+{
+	switch (cmd) {
+	case FIONBIO:
+		return (0);
+	case FIOASYNC:
+		if (*(int *)data != 0)
+			return (EINVAL);
+		return (0);
+	default:
+		return (ENOTTY);
+	}
+}
+
+static int
+echo_aio_fo_stat(struct file *fp, struct stat *sb, struct ucred *active_cred)
+{
+	bzero(sb, sizeof(*sb));
+	sb->st_mode = S_IFCHR | S_IRUSR | S_IWUSR;
+	return (0);
+}
+
+static int
+echo_aio_fo_close(struct file *fp, struct thread *td)
+{
+	struct echodev_file *ef = fp->f_data;
+
+	if ((fp->f_flag & FWRITE) != 0)
+		echo_drop_writer(ef->wsc);
+	free(ef, M_ECHODEV);
+	fp->f_ops = &badfileops;
+	mtx_lock(&echo_aio_mtx);
+	echo_aio_files--;
+	mtx_unlock(&echo_aio_mtx);
+	return (0);
+}
+
+static int
+echo_aio_fo_fill_kinfo(struct file *fp, struct kinfo_file *kif,
+    struct filedesc *fdp)
+{
+	kif->kf_type = KF_TYPE_UNKNOWN;
+	return (0);
+}
+
+/*
+ * Create an AIO descriptor for the same instances as an existing
+ * descriptor with the same access mode.
+ */
+static int
+echo_aio_fd(struct echodev_file *ef, int fflag, int *fdp, struct thread *td)
+{
+	struct echodev_file *aef;
+	struct file *fp;
+	int error, fd;
+
+	if (ef->agg != NULL)
+		return (EBUSY);
+
+	mtx_lock(&echo_aio_mtx);
+	if (echo_aio_dying) {
+		mtx_unlock(&echo_aio_mtx);
+		return (ENXIO);
+	}
+	echo_aio_files++;
+	mtx_unlock(&echo_aio_mtx);
+
+	error = 0;
+	if ((fflag & FWRITE) != 0)
+		error = echo_add_writer(ef->wsc);
+	if (error == 0) {
+		error = falloc(td, &fp, &fd, 0);
+		if (error != 0 && (fflag & FWRITE) != 0)
+			echo_drop_writer(ef->wsc);
+	}
+	if (error != 0) {
+		mtx_lock(&echo_aio_mtx);
+		echo_aio_files--;
+		mtx_unlock(&echo_aio_mtx);
+		return (error);
+	}
+
+	aef = malloc(sizeof(*aef), M_ECHODEV, M_WAITOK | M_ZERO);
+	aef->rsc = ef->rsc;
+	aef->wsc = ef->wsc;
+	finit(fp, fflag & (FREAD | FWRITE), DTYPE_NONE, aef,
+	    &echo_aio_fileops);
+	fdrop(fp, td);
+	*fdp = fd;
+	return (0);
+}
+
+/*
+ * Replace the buffer with a new buffer of a different size.  The new
+ * buffer is allocated before acquiring the lock so that I/O is not
+ * stalled while the allocator sleeps.  If the buffer holds more data
+ * than will fit in the new size, wait for readers to drain it.
+ */
+static int
+echo_resize(struct echodev_softc *sc, size_t new_len, int fflag)
+{
+	char *new_buf, *old_buf;
+	int error;
+
+	if (new_len > ECHODEV_BUFSIZE_MAX)
+		return (EINVAL);
+
+	/* Nothing to do. */
+	echo_slock(sc, LS_IOCTL);
+	if (new_len == sc->len && !sc->resizing) {
+		sx_sunlock(&sc->lock);
+		return (0);
+	}
+	sx_sunlock(&sc->lock);
+
+	new_buf = malloc(new_len, M_ECHODEV, M_WAITOK | M_ZERO);
+
+	echo_xlock(sc, LS_IOCTL);
+
+	/* Wait for any other resize requests to finish. */
+	while (sc->resizing) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (fflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else
+			error = echo_sx_sleep(sc, "echors");
+		if (error != 0) {
+			echo_xunlock(sc);
+			free(new_buf, M_ECHODEV);
+			return (error);
+		}
+	}
+
+	if (new_len == sc->len) {
+		/* Nothing to do. */
+		echo_xunlock(sc);
+		free(new_buf, M_ECHODEV);
+		return (0);
+	}
+
+	/* Hold off writers and wait for readers to drain the buffer. */
+	sc->resizing = true;
+	sc->resize_len = new_len;
+	error = 0;
+	while (sc->valid + sc->reserved > new_len) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (fflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else
+			error = echo_sx_sleep(sc, "echors");
+		if (error != 0)
+			break;
+	}
+
+	if (error == 0) {
+		memcpy(new_buf, sc->buf, sc->valid);
+		old_buf = sc->buf;
+		SDT_PROBE3(echodev, , , resize, sc, sc->len, new_len);
+		echo_trace(sc, ECHODEV_TRACE_RESIZE, new_len);
+		echo_occ_update(sc);
+		sc->buf = new_buf;
+		sc->len = new_len;
+		echo_occ_reset(sc);
+		echo_status_update(sc);
+		echo_count(sc, ES_RESIZES, 1);
+	} else
+		old_buf = new_buf;
+	sc->resizing = false;
+
+	/* Wakeup any waiting writers or other resize requests. */
+	echo_wakeup(sc);
+	if (echo_space(sc) != 0) {
+		echo_notify_write(sc);
+	}
+	echo_xunlock(sc);
+
+	free(old_buf, M_ECHODEV);
+	return (error);
+}
+
+static struct echodev_ringbuf *
+echo_ring_alloc(size_t size)
+{
+	struct echodev_ringbuf *ring;
+	vm_offset_t kva;
+	vm_page_t m;
+	u_int i, npages;
+
+	ring = malloc(sizeof(*ring), M_ECHODEV, M_WAITOK | M_ZERO);
+	ring->size = size;
+	ring->mapsize = PAGE_SIZE + size;
+	ring->obj = vm_pager_allocate(OBJT_SWAP, NULL, ring->mapsize,
+	    VM_PROT_DEFAULT, 0, NULL);
+	if (ring->obj == NULL) {
+		free(ring, M_ECHODEV);
+		return (NULL);
+	}
+	kva = kva_alloc(ring->mapsize);
+	if (kva == 0) {
+		vm_object_deallocate(ring->obj);
+		free(ring, M_ECHODEV);
+		return (NULL);
+	}
+
+	/* Wire the pages so they can be accessed from the kernel mapping. */
+	npages = atop(ring->mapsize);
+	ring->pages = malloc(npages * sizeof(*ring->pages), M_ECHODEV,
+	    M_WAITOK);
+	VM_OBJECT_WLOCK(ring->obj);
+	for (i = 0; i < npages; i++) {
+		m = vm_page_grab(ring->obj, i, VM_ALLOC_NORMAL |
+		    VM_ALLOC_WIRED | VM_ALLOC_ZERO);
+		vm_page_valid(m);
+		vm_page_xunbusy(m);
+		ring->pages[i] = m;
+	}
+	VM_OBJECT_WUNLOCK(ring->obj);
+	pmap_qenter(kva, ring->pages, npages);
+
+	ring->hdr = (struct echodev_ring *)kva;
+	ring->hdr->er_size = size;
+	ring->hdr->er_offset = PAGE_SIZE;
+	return (ring);
+}
+
+/*
+ * Release the kernel's references to a shared ring.  Existing user
+ * mappings hold their own reference on the VM object.
+ */
+static void
+echo_ring_free(struct echodev_ringbuf *ring)
+{
+	u_int i, npages;
+
+	npages = atop(ring->mapsize);
+	pmap_qremove((vm_offset_t)ring->hdr, npages);
+	kva_free((vm_offset_t)ring->hdr, ring->mapsize);
+	for (i = 0; i < npages; i++)
+		vm_page_unwire(ring->pages[i], PQ_ACTIVE);
+	vm_object_deallocate(ring->obj);
+	free(ring->pages, M_ECHODEV);
+	free(ring, M_ECHODEV);
+}
+
+/*
+ * Switch between the buffer and a shared ring of the requested size.
+ * A size of zero reverts to the buffer.
+ */
+static int
+echo_set_ring(struct echodev_softc *sc, size_t size)
+{
+	struct echodev_ringbuf *new_ring, *old_ring;
+
+	if (size != 0) {
+		if (size < PAGE_SIZE || size > ECHODEV_RING_MAX ||
+		    !powerof2(size))
+			return (EINVAL);
+		new_ring = echo_ring_alloc(size);
+		if (new_ring == NULL)
+			return (ENOMEM);
+	} else
+		new_ring = NULL;
+
+	echo_xlock(sc, LS_IOCTL);
+	if (new_ring != NULL && (echo_mapped(sc) || sc->record_mode ||
+	    echo_bytes_pending(sc))) {
+		echo_xunlock(sc);
+		echo_ring_free(new_ring);
+		return (EBUSY);
+	}
+	old_ring = sc->ring;
+	sc->ring = new_ring;
+
+	/* Force any sleeping threads to reevaluate the mode. */
+	echo_wakeup(sc);
+	echo_notify_read(sc);
+	echo_notify_write(sc);
+	echo_xunlock(sc);
+
+	if (old_ring != NULL)
+		echo_ring_free(old_ring);
+	return (0);
+}
+
+static struct echodev_blockset *
+echo_blocks_alloc(u_int count, size_t size)
+{
+	struct echodev_blockset *bs;
+	u_int i;
+
+	bs = malloc(sizeof(*bs), M_ECHODEV, M_WAITOK | M_ZERO);
+	bs->obj = vm_pager_allocate(OBJT_SWAP, NULL, count * size,
+	    VM_PROT_DEFAULT, 0, NULL);
+	if (bs->obj == NULL) {
+		free(bs, M_ECHODEV);
+		return (NULL);
+	}
+	bs->size = size;
+	bs->count = count;
+	bs->state = mallocarray(count, sizeof(*bs->state), M_ECHODEV,
+	    M_WAITOK);
+	bs->lens = mallocarray(count, sizeof(*bs->lens), M_ECHODEV,
+	    M_WAITOK | M_ZERO);
+	bs->freeq = mallocarray(count, sizeof(*bs->freeq), M_ECHODEV,
+	    M_WAITOK);
+	bs->filledq = mallocarray(count, sizeof(*bs->filledq), M_ECHODEV,
+	    M_WAITOK);
+	for (i = 0; i < count; i++) {
+		bs->state[i] = EB_FREE;
+		bs->freeq[i] = i;
+	}
+	bs->free_count = count;
+	return (bs);
+}
+
+static void
+echo_blocks_free(struct echodev_blockset *bs)
+{
+	vm_object_deallocate(bs->obj);
+	free(bs->filledq, M_ECHODEV);
+	free(bs->freeq, M_ECHODEV);
+	free(bs->lens, M_ECHODEV);
+	free(bs->state, M_ECHODEV);
+	free(bs, M_ECHODEV);
+}
+
+/*
+ * Switch between the buffer and a set of mapped buffers.  A count of
+ * zero reverts to the buffer.
+ */
+static int
+echo_set_blocks(struct echodev_softc *sc, const struct echodev_blocks *eb)
+{
+	struct echodev_blockset *new_bs, *old_bs;
+
+	if (eb->eb_count != 0) {
+		if (eb->eb_count < 2 || eb->eb_count > ECHODEV_BLOCKS_MAX ||
+		    eb->eb_size == 0 || eb->eb_size % PAGE_SIZE != 0 ||
+		    eb->eb_size > ECHODEV_RING_MAX / eb->eb_count)
+			return (EINVAL);
+		new_bs = echo_blocks_alloc(eb->eb_count, eb->eb_size);
+		if (new_bs == NULL)
+			return (ENOMEM);
+	} else
+		new_bs = NULL;
+
+	echo_xlock(sc, LS_IOCTL);
+	if (new_bs != NULL && (echo_mapped(sc) || sc->record_mode ||
+	    echo_bytes_pending(sc))) {
+		echo_xunlock(sc);
+		echo_blocks_free(new_bs);
+		return (EBUSY);
+	}
+	old_bs = sc->blocks;
+	sc->blocks = new_bs;
+
+	/* Force any sleeping threads to reevaluate the mode. */
+	echo_wakeup(sc);
+	echo_notify_read(sc);
+	echo_notify_write(sc);
+	echo_xunlock(sc);
+
+	if (old_bs != NULL)
+		echo_blocks_free(old_bs);
+	return (0);
+}
+
+/*
+ * Producer side of block mode.  Queue the filled buffer (if any) for
+ * the consumer and return the next free buffer, waiting for the
+ * consumer to release one if necessary.
+ */
+static int
+echo_block_swap(struct echodev_softc *sc, struct echodev_swap *es, int fflag)
+{
+	struct echodev_blockset *bs;
+	u_int idx;
+	int error;
+
+	echo_xlock(sc, LS_IOCTL);
+	bs = sc->blocks;
+	if (bs == NULL) {
+		echo_xunlock(sc);
+		return (EINVAL);
+	}
+
+	if (es->es_index != -1) {
+		idx = es->es_index;
+		if (idx >= bs->count || bs->state[idx] != EB_PRODUCER ||
+		    es->es_len > bs->size) {
+			echo_xunlock(sc);
+			return (EINVAL);
+		}
+
+		/* Wakeup any waiting consumers. */
+		if (bs->filled_count == 0)
+			echo_wakeup(sc);
+
+		bs->state[idx] = EB_FILLED;
+		bs->lens[idx] = es->es_len;
+		bs->filledq[(bs->filled_head + bs->filled_count) % bs->count] =
+		    idx;
+		bs->filled_count++;
+		echo_notify_read(sc);
+	}
+
+	/* Wait for a free buffer. */
+	while (bs->free_count == 0) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (fflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else
+			error = echo_sleep(sc, false, "echobs");
+		if (error == 0 && sc->blocks != bs)
+			error = EINVAL;
+		if (error != 0) {
+			echo_xunlock(sc);
+			return (error);
+		}
+	}
+
+	idx = bs->freeq[bs->free_head];
+	bs->free_head = (bs->free_head + 1) % bs->count;
+	bs->free_count--;
+	bs->state[idx] = EB_PRODUCER;
+	es->es_index = idx;
+	es->es_len = bs->size;
+	echo_xunlock(sc);
+	return (0);
+}
+
+/*
+ * Consumer side of block mode.  Return the consumed buffer (if any)
+ * to the free queue and return the next filled buffer, waiting for
+ * the producer to queue one if necessary.  If there are no writers,
+ * an index of -1 is returned to indicate EOF.
+ */
+static int
+echo_block_release(struct echodev_softc *sc, struct echodev_swap *es,
+    int fflag)
+{
+	struct echodev_blockset *bs;
+	u_int idx;
+	int error;
+
+	echo_xlock(sc, LS_IOCTL);
+	bs = sc->blocks;
+	if (bs == NULL) {
+		echo_xunlock(sc);
+		return (EINVAL);
+	}
+
+	if (es->es_index != -1) {
+		idx = es->es_index;
+		if (idx >= bs->count || bs->state[idx] != EB_CONSUMER) {
+			echo_xunlock(sc);
+			return (EINVAL);
+		}
+
+		/* Wakeup any waiting producers. */
+		if (bs->free_count == 0)
+			echo_wakeup(sc);
+
+		bs->state[idx] = EB_FREE;
+		bs->freeq[(bs->free_head + bs->free_count) % bs->count] = idx;
+		bs->free_count++;
+		echo_notify_write(sc);
+	}
+
+	/* Wait for a filled buffer. */
+	while (bs->filled_count == 0 && sc->writers != 0) {
+		if (sc->dying)
+			error = ENXIO;
+		else if (fflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else
+			error = echo_sleep(sc, true, "echobr");
+		if (error == 0 && sc->blocks != bs)
+			error = EINVAL;
+		if (error != 0) {
+			echo_xunlock(sc);
+			return (error);
+		}
+	}
+
+	if (bs->filled_count == 0) {
+		es->es_index = -1;
+		es->es_len = 0;
+		echo_xunlock(sc);
+		return (0);
+	}
+
+	idx = bs->filledq[bs->filled_head];
+	bs->filled_head = (bs->filled_head + 1) % bs->count;
+	bs->filled_count--;
+	bs->state[idx] = EB_CONSUMER;
+	es->es_index = idx;
+	es->es_len = bs->lens[idx];
+	echo_xunlock(sc);
+	return (0);
+}
+
+static int
+echo_fo_write(struct file *fp, void *buf, size_t len, size_t *donep,
+    struct thread *td)
+{
+	struct iovec aiov;
+	struct uio auio;
+	int error;
+
+	aiov.iov_base = buf;
+	aiov.iov_len = len;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = len;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_WRITE;
+	auio.uio_td = td;
+	if (fp->f_type == DTYPE_VNODE)
+		bwillwrite();
+	error = fo_write(fp, &auio, td->td_ucred, 0, td);
+	*donep = len - auio.uio_resid;
+	return (error);
+}
+
+static int
+echo_fo_read(struct file *fp, void *buf, size_t len, size_t *donep,
+    struct thread *td)
+{
+	struct iovec aiov;
+	struct uio auio;
+	int error;
+
+	aiov.iov_base = buf;
+	aiov.iov_len = len;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = len;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_READ;
+	auio.uio_td = td;
+	error = fo_read(fp, &auio, td->td_ucred, 0, td);
+	*donep = len - auio.uio_resid;
+	return (error);
+}
+
+/*
+ * Move data from a pending direct write into the empty buffer so that
+ * it can be spliced like buffered data.
+ */
+static void
+echo_direct_absorb(struct echodev_softc *sc)
+{
+	struct iovec iov;
+	struct uio uio;
+	size_t n;
+
+	KASSERT(sc->valid == 0, ("%s: buffer not empty", __func__));
+	if (sc->reserved >= sc->len)
+		return;
+	n = MIN(sc->direct_len, sc->len - sc->reserved);
+	iov.iov_base = sc->buf;
+	iov.iov_len = n;
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_offset = 0;
+	uio.uio_resid = n;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_rw = UIO_READ;
+	uio.uio_td = curthread;
+	if (uiomove_fromphys(sc->direct_pages, sc->direct_off, n, &uio) != 0)
+		return;
+	sc->valid = n;
+	echo_occ_update(sc);
+	sc->direct_off += n;
+	sc->direct_len -= n;
+
+	/* Wakeup the direct writer. */
+	if (sc->direct_len == 0)
+		echo_wakeup(sc);
+}
+
+/*
+ * Move up to es_len bytes from the buffer to another file.  Each
+ * chunk is copied to a bounce buffer and only removed from the buffer
+ * once it has been written, so a short write to the other file does
+ * not lose data.  Readers wait while a chunk is in flight.  Direct
+ * writes are disabled while a splice is pending, and data from a
+ * direct write already in progress is first moved into the buffer.
+ */
+static int
+echo_splice_out(struct echodev_softc *sc, struct echodev_splice *es,
+    int fflag, struct thread *td)
+{
+	struct file *fp;
+	char *buf;
+	size_t done, n, written;
+	int error;
+
+	if (es->es_len == 0)
+		return (0);
+
+	error = fget_write(td, es->es_fd, &cap_write_rights, &fp);
+	if (error != 0)
+		return (error);
+	buf = malloc(MIN(es->es_len, ECHO_SPLICE_MAX), M_ECHODEV, M_WAITOK);
+
+	done = 0;
+	echo_xlock(sc, LS_IOCTL);
+	sc->splicers++;
+	while (done < es->es_len) {
+		/* Wait for bytes to splice and for other splices to finish. */
+		while ((sc->valid == 0 && sc->direct_len == 0 &&
+		    sc->writers != 0) || sc->splice_busy) {
+			if (sc->dying)
+				error = ENXIO;
+			else if (echo_mapped(sc) || sc->record_mode)
+				error = EINVAL;
+			else if (done != 0 || (fflag & O_NONBLOCK))
+				error = EWOULDBLOCK;
+			else
+				error = echo_sleep(sc, true, "echoso");
+			if (error != 0)
+				goto out;
+		}
+		if (sc->valid == 0 && sc->direct_len != 0)
+			echo_direct_absorb(sc);
+		if (sc->valid == 0)
+			break;
+
+		n = MIN(es->es_len - done, MIN(ECHO_SPLICE_MAX, sc->valid));
+		memcpy(buf, sc->buf, n);
+		sc->splice_busy = true;
+		echo_xunlock(sc);
+
+		error = echo_fo_write(fp, buf, n, &written, td);
+
+		echo_xlock(sc, LS_IOCTL);
+		sc->splice_busy = false;
+
+		/* Wakeup any readers waiting for the splice to finish. */
+		echo_wakeup(sc);
+		if (written != 0)
+			echo_consume(sc, written);
+		echo_subs_ready(sc);
+		done += written;
+		if (error != 0 || written < n)
+			break;
+	}
+out:
+	sc->splicers--;
+	echo_xunlock(sc);
+	free(buf, M_ECHODEV);
+	fdrop(fp, td);
+
+	es->es_len = done;
+	if (done != 0)
+		error = 0;
+	return (error);
+}
+
+/*
+ * Move up to es_len bytes from another file into the buffer.  Space
+ * for each chunk is reserved before reading from the other file so
+ * that the data read can always be appended.  Direct writes are
+ * disabled while a splice is pending so they cannot pass the data.
+ */
+static int
+echo_splice_in(struct echodev_softc *sc, struct echodev_splice *es,
+    int fflag, struct thread *td)
+{
+	struct file *fp;
+	char *buf;
+	size_t done, n, nread;
+	int error;
+
+	if (es->es_len == 0)
+		return (0);
+
+	error = fget_read(td, es->es_fd, &cap_read_rights, &fp);
+	if (error != 0)
+		return (error);
+	buf = malloc(MIN(es->es_len, ECHO_SPLICE_MAX), M_ECHODEV, M_WAITOK);
+
+	done = 0;
+	echo_xlock(sc, LS_IOCTL);
+	sc->splicers++;
+	while (done < es->es_len) {
+		/* Wait for space to splice. */
+		while (echo_mapped(sc) || sc->record_mode ||
+		    echo_space(sc) == 0) {
+			if (sc->dying)
+				error = ENXIO;
+			else if (echo_mapped(sc) || sc->record_mode)
+				error = EINVAL;
+			else if (done != 0 || (fflag & O_NONBLOCK))
+				error = EWOULDBLOCK;
+			else
+				error = echo_sleep(sc, false, "echosi");
+			if (error != 0)
+				goto out;
+		}
+
+		n = MIN(es->es_len - done, MIN(ECHO_SPLICE_MAX,
+		    echo_space(sc)));
+		sc->reserved += n;
+		echo_xunlock(sc);
+
+		error = echo_fo_read(fp, buf, n, &nread, td);
+
+		echo_xlock(sc, LS_IOCTL);
+		sc->reserved -= n;
+		if (nread != 0) {
+			/* Wakeup any waiting readers. */
+			if (sc->valid == 0)
+				echo_wakeup(sc);
+
+			memcpy(sc->buf + sc->valid, buf, nread);
+			sc->valid += nread;
+			echo_notify_read(sc);
+		}
+		if (nread < n) {
+			/* Wakeup any writers waiting for unused space. */
+			echo_wakeup(sc);
+			echo_notify_write(sc);
+		}
+		done += nread;
+		if (error != 0 || nread < n)
+			break;
+	}
+out:
+	sc->splicers--;
+	echo_xunlock(sc);
+	free(buf, M_ECHODEV);
+	fdrop(fp, td);
+
+	es->es_len = done;
+	if (done != 0)
+		error = 0;
+	return (error);
+}
+
+/* Returns true if data can be forwarded through a link. */
+static bool
+echo_link_ok(struct echodev_softc *sc)
+{
+	return (!sc->dying && !echo_mapped(sc) && !sc->record_mode);
+}
+
+/*
+ * Forward data from the source of a link to its destination until the
+ * source is empty or the destination is full.  Like splice, each
+ * chunk is only removed from the source once the destination has
+ * accepted it.
+ */
+static void
+echo_link_task(void *arg, int pending)
+{
+	struct echodev_link *link = arg;
+	struct echodev_softc *src = link->src;
+	struct echodev_softc *dst = link->dst;
+	size_t moved, n;
+
+	for (;;) {
+		echo_xlock(src, LS_READ);
+		if (!echo_link_ok(src) || src->valid == 0 ||
+		    src->splice_busy) {
+			if (src->valid == 0)
+				counter_u64_add(link->src_empty, 1);
+			echo_xunlock(src);
+			return;
+		}
+		n = MIN(src->valid, sizeof(link->buf));
+		memcpy(link->buf, src->buf, n);
+		src->splice_busy = true;
+		echo_xunlock(src);
+
+		echo_xlock(dst, LS_WRITE);
+		if (echo_link_ok(dst) && !dst->direct_active)
+			moved = MIN(n, echo_space(dst));
+		else
+			moved = 0;
+		if (moved != 0) {
+			/* Wakeup any waiting readers. */
+			if (dst->valid == 0)
+				echo_wakeup(dst);
+
+			memcpy(dst->buf + dst->valid, link->buf, moved);
+			dst->valid += moved;
+			echo_notify_read(dst);
+		} else
+			counter_u64_add(link->dst_full, 1);
+		echo_xunlock(dst);
+
+		echo_xlock(src, LS_READ);
+		src->splice_busy = false;
+
+		/* Wakeup any readers waiting for the forward to finish. */
+		echo_wakeup(src);
+		if (moved != 0)
+			echo_consume(src, moved);
+		echo_subs_ready(src);
+		echo_xunlock(src);
+
+		if (moved == 0)
+			return;
+		counter_u64_add(link->bytes, moved);
+		counter_u64_add(link->forwards, 1);
+	}
+}
+
+static void
+echo_link_free(struct echodev_link *link)
+{
+	counter_u64_free(link->bytes);
+	counter_u64_free(link->forwards);
+	counter_u64_free(link->src_empty);
+	counter_u64_free(link->dst_full);
+	free(link, M_ECHODEV);
+}
+
+static void
+echo_unlink_locked(struct echodev_softc *sc)
+{
+	struct echodev_link *link;
+
+	sx_assert(&echo_links_lock, SA_XLOCKED);
+	link = sc->out_link;
+	if (link == NULL)
+		return;
+
+	echo_xlock(link->dst, LS_IOCTL);
+	TAILQ_REMOVE(&link->dst->in_links, link, dst_link);
+	echo_xunlock(link->dst);
+
+	echo_xlock(sc, LS_IOCTL);
+	sc->out_link = NULL;
+	echo_xunlock(sc);
+
+	taskqueue_drain(taskqueue_thread, &link->task);
+	echo_link_free(link);
+}
+
+/*
+ * Forward the output of an instance to the input of the instance
+ * with the given unit number, or remove the existing link if the
+ * unit is -1.
+ */
+static int
+echo_link(struct echodev_softc *sc, int unit)
+{
+	struct echodev_link *link;
+	struct echodev_softc *dst, *next;
+	int error;
+
+	if (unit == -1) {
+		sx_xlock(&echo_links_lock);
+		echo_unlink_locked(sc);
+		sx_xunlock(&echo_links_lock);
+		return (0);
+	}
+	if (unit < 0 || (u_int)unit >= echo_units)
+		return (ENXIO);
+	dst = echo_softcs[unit];
+
+	link = malloc(sizeof(*link), M_ECHODEV, M_WAITOK | M_ZERO);
+	link->src = sc;
+	link->dst = dst;
+	link->bytes = counter_u64_alloc(M_WAITOK);
+	link->forwards = counter_u64_alloc(M_WAITOK);
+	link->src_empty = counter_u64_alloc(M_WAITOK);
+	link->dst_full = counter_u64_alloc(M_WAITOK);
+	TASK_INIT(&link->task, 0, echo_link_task, link);
+
+	sx_xlock(&echo_links_lock);
+	if (echo_links_dying || sc->out_link != NULL) {
+		error = echo_links_dying ? ENXIO : EBUSY;
+		sx_xunlock(&echo_links_lock);
+		echo_link_free(link);
+		return (error);
+	}
+
+	/* Reject links that would form a cycle. */
+	for (next = dst; next != NULL;
+	    next = next->out_link != NULL ? next->out_link->dst : NULL) {
+		if (next == sc) {
+			sx_xunlock(&echo_links_lock);
+			echo_link_free(link);
+			return (ELOOP);
+		}
+	}
+
+	echo_xlock(dst, LS_IOCTL);
+	TAILQ_INSERT_TAIL(&dst->in_links, link, dst_link);
+	echo_xunlock(dst);
+
+	echo_xlock(sc, LS_IOCTL);
+	sc->out_link = link;
+	taskqueue_enqueue(taskqueue_thread, &link->task);
+	echo_xunlock(sc);
+	sx_xunlock(&echo_links_lock);
+	return (0);
+}
+
+static void
+echo_link_stats(struct echodev_softc *sc, struct echodev_link_stats *els)
+{
+	struct echodev_link *link;
+
+	sx_slock(&echo_links_lock);
+	link = sc->out_link;
+	if (link != NULL) {
+		els->el_unit = link->dst->unit;
+		els->el_bytes = counter_u64_fetch(link->bytes);
+		els->el_forwards = counter_u64_fetch(link->forwards);
+		els->el_src_empty = counter_u64_fetch(link->src_empty);
+		els->el_dst_full = counter_u64_fetch(link->dst_full);
+	} else {
+		memset(els, 0, sizeof(*els));
+		els->el_unit = -1;
+	}
+	sx_sunlock(&echo_links_lock);
+}
+
+/*
+ * Turn a descriptor into one endpoint of a pair.  Endpoint 0 writes
+ * to the instance and reads from its peer.  Endpoint 1 writes to the
+ * peer and reads from the instance.  The peer direction is allocated
+ * on first use and has its own buffer, lock, and wait channels.  All
+ * pairs on a unit share the peer.  While no endpoint 1 is open, a
+ * writer is reserved on the peer for the next one so that endpoint 0
+ * does not see EOF before its partner joins.
+ */
+static int
+echo_pair(struct echodev_softc *sc, struct echodev_file *ef, int side,
+    int fflag)
+{
+	struct echodev_softc *peer;
+	bool reserved;
+	int error;
+
+	if (side != 0 && side != 1)
+		return (EINVAL);
+	if (ef->rsc != sc || ef->wsc != sc || ef->async)
+		return (EBUSY);
+
+	echo_slock(sc, LS_IOCTL);
+	peer = sc->peer;
+	sx_sunlock(&sc->lock);
+	if (peer == NULL) {
+		peer = echodev_alloc(sc->unit, sc->len);
+		echo_xlock(sc, LS_IOCTL);
+		if (sc->peer == NULL) {
+			sc->peer = peer;
+			peer = NULL;
+		}
+		echo_xunlock(sc);
+		if (peer != NULL)
+			echodev_free(peer);
+		peer = sc->peer;
+	}
+
+	if (side == 0) {
+		/* Reserve a writer unless an endpoint 1 is open. */
+		error = echo_add_writer(peer);
+		if (error != 0)
+			return (error);
+		echo_xlock(sc, LS_IOCTL);
+		reserved = !sc->peer_reserved && sc->pair1_open == 0;
+		if (reserved)
+			sc->peer_reserved = true;
+		echo_xunlock(sc);
+		if (!reserved)
+			echo_drop_writer(peer);
+		ef->rsc = peer;
+		return (0);
+	}
 
+	/* Endpoint 1 takes over any reserved writer. */
+	echo_xlock(sc, LS_IOCTL);
+	reserved = sc->peer_reserved;
+	sc->peer_reserved = false;
+	sc->pair1_open++;
+	echo_xunlock(sc);
 	if ((fflag & FWRITE) != 0) {
-		/* Increase the number of writers. */
-		sx_xlock(&sc->lock);
-		if (sc->writers == UINT_MAX) {
-			sx_xunlock(&sc->lock);
-			return (EBUSY);
+		/* Move this writer to the peer direction. */
+		if (!reserved) {
+			error = echo_add_writer(peer);
+			if (error != 0) {
+				echo_xlock(sc, LS_IOCTL);
+				sc->pair1_open--;
+				echo_xunlock(sc);
+				return (error);
+			}
 		}
-		sc->writers++;
-		sx_xunlock(&sc->lock);
-	}
+		echo_drop_writer(sc);
+	} else if (reserved)
+		echo_drop_writer(peer);
+	ef->wsc = peer;
 	return (0);
 }
 
+/*
+ * Subscribe an aggregator descriptor to the instance with the given
+ * unit number.  The first subscription turns the descriptor into an
+ * aggregator.
+ */
 static int
-echo_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
+echo_subscribe(struct echodev_file *ef, int unit)
 {
-	struct echodev_softc *sc = dev->si_drv1;
+	struct echodev_agg *agg;
+	struct echodev_softc *sc;
+	struct echodev_sub *sub, *sub2;
 
-	if ((fflag & FWRITE) != 0) {
-		sx_xlock(&sc->lock);
-		sc->writers--;
-		if (sc->writers == 0) {
-			/* Wakeup any waiting readers. */
-			wakeup(sc);
-			selwakeup(&sc->rsel);
-			KNOTE_LOCKED(&sc->rsel.si_note, 0);
+	if (unit < 0 || (u_int)unit >= echo_units)
+		return (ENXIO);
+	sc = echo_softcs[unit];
+	if (ef->rsc != ef->wsc)
+		return (EBUSY);
+
+	/* Racing first subscriptions keep whichever aggregator wins. */
+	if (ef->agg == NULL) {
+		agg = malloc(sizeof(*agg), M_ECHODEV, M_WAITOK | M_ZERO);
+		sx_init(&agg->sublock, "echo agg subs");
+		mtx_init(&agg->mtx, "echo agg", NULL, MTX_DEF);
+		knlist_init_mtx(&agg->sel.si_note, &agg->mtx);
+		TAILQ_INIT(&agg->subs);
+		TAILQ_INIT(&agg->ready);
+		if (!atomic_cmpset_ptr((volatile uintptr_t *)&ef->agg,
+		    (uintptr_t)NULL, (uintptr_t)agg)) {
+			knlist_destroy(&agg->sel.si_note);
+			mtx_destroy(&agg->mtx);
+			sx_destroy(&agg->sublock);
+			free(agg, M_ECHODEV);
+		}
+	}
+	agg = ef->agg;
+
+	sub = malloc(sizeof(*sub), M_ECHODEV, M_WAITOK | M_ZERO);
+	sub->agg = agg;
+	sub->sc = sc;
+
+	sx_xlock(&agg->sublock);
+	echo_xlock(sc, LS_IOCTL);
+	TAILQ_FOREACH(sub2, &sc->subs, sc_link) {
+		if (sub2->agg == agg) {
+			echo_xunlock(sc);
+			sx_xunlock(&agg->sublock);
+			free(sub, M_ECHODEV);
+			return (EEXIST);
 		}
-		sx_xunlock(&sc->lock);
 	}
+	TAILQ_INSERT_TAIL(&sc->subs, sub, sc_link);
+	mtx_lock(&agg->mtx);
+	TAILQ_INSERT_TAIL(&agg->subs, sub, agg_link);
+	mtx_unlock(&agg->mtx);
+	if (sc->valid != 0)
+		echo_agg_ready(sub);
+	echo_xunlock(sc);
+	sx_xunlock(&agg->sublock);
 	return (0);
 }
 
 static int
-echo_read(struct cdev *dev, struct uio *uio, int ioflag)
+echo_unsubscribe(struct echodev_file *ef, int unit)
 {
-	struct echodev_softc *sc = dev->si_drv1;
-	size_t todo;
-	int error;
-
-	if (uio->uio_resid == 0)
-		return (0);
+	struct echodev_agg *agg = ef->agg;
+	struct echodev_sub *sub;
 
-	sx_xlock(&sc->lock);
-
-	/* Wait for bytes to read. */
-	while (sc->valid == 0 && sc->writers != 0) {
-		if (sc->dying)
-			error = ENXIO;
-		else if (ioflag & O_NONBLOCK)
-			error = EWOULDBLOCK;
-		else
-			error = sx_sleep(sc, &sc->lock, PCATCH, "echord", 0);
-		if (error != 0) {
-			sx_xunlock(&sc->lock);
-			return (error);
-		}
+	if (agg == NULL)
+		return (ENOENT);
+	sx_xlock(&agg->sublock);
+	TAILQ_FOREACH(sub, &agg->subs, agg_link) {
+		if (sub->sc->unit == unit)
+			break;
 	}
+	if (sub != NULL)
+		echo_unsubscribe_one(sub);
+	sx_xunlock(&agg->sublock);
+	return (sub == NULL ? ENOENT : 0);
+}
 
-	todo = MIN(uio->uio_resid, sc->valid);
-	error = uiomove(sc->buf, todo, uio);
-	if (error == 0) {
-		/* Wakeup any waiting writers. */
-		if (sc->valid == sc->len)
-			wakeup(sc);
+static void
+echo_stats(struct echodev_softc *sc, struct echodev_stats *es)
+{
+	uint64_t *counts = (uint64_t *)es;
+	int i;
 
-		sc->valid -= todo;
-		memmove(sc->buf, sc->buf + todo, sc->valid);
-		selwakeup(&sc->wsel);
-		KNOTE_LOCKED(&sc->wsel.si_note, 0);
-	}
-	sx_xunlock(&sc->lock);
-	return (error);
+	for (i = 0; i < ES_NSTATS; i++)
+		counts[i] = counter_u64_fetch(sc->stats[i]);
 }
 
-static int
-echo_write(struct cdev *dev, struct uio *uio, int ioflag)
+static void
+echo_hist_fetch(struct echodev_softc *sc, int which, uint64_t *buckets)
 {
-	struct echodev_softc *sc = dev->si_drv1;
-	size_t todo;
-	int error;
+	int i;
 
-	if (uio->uio_resid == 0)
-		return (0);
+	for (i = 0; i < ECHODEV_HIST_BUCKETS; i++)
+		buckets[i] = counter_u64_fetch(sc->hist[which][i]);
+}
 
-	sx_xlock(&sc->lock);
-	while (uio->uio_resid != 0) {
-		/* Wait for space to write. */
-		while (sc->valid == sc->len) {
-			if (sc->dying)
-				error = ENXIO;
-			else if (ioflag & O_NONBLOCK)
-				error = EWOULDBLOCK;
-			else
-				error = sx_sleep(sc, &sc->lock, PCATCH, "echowr",
-				    0);
-			if (error != 0) {
-				sx_xunlock(&sc->lock);
-				return (error);
-			}
-		}
+/*
+ * Returns the instance an ioctl acts on.  On a paired endpoint,
+ * requests that drain or report on the data it receives act on the
+ * direction it reads, and others on the direction it writes.
+ */
+/* Returns true if the calling descriptor is a pair endpoint. */
+static bool
+echo_file_paired(void)
+{
+	struct echodev_file *ef;
 
-		todo = MIN(uio->uio_resid, sc->len - sc->valid);
-		error = uiomove(sc->buf + sc->valid, todo, uio);
-		if (error == 0) {
-			/* Wakeup any waiting readers. */
-			if (sc->valid == 0)
-				wakeup(sc);
+	return (devfs_get_cdevpriv((void **)&ef) == 0 && ef->rsc != ef->wsc);
+}
 
-			sc->valid += todo;
-			selwakeup(&sc->rsel);
-			KNOTE_LOCKED(&sc->rsel.si_note, 0);
-		}
+static struct echodev_softc *
+echo_ioctl_softc(struct cdev *dev, u_long cmd)
+{
+	struct echodev_file *ef;
+
+	if (cmd == ECHODEV_PAIR || devfs_get_cdevpriv((void **)&ef) != 0)
+		return (dev->si_drv1);
+	switch (cmd) {
+	case ECHODEV_BRELEASE:
+	case ECHODEV_RECV:
+	case ECHODEV_SPLICE_OUT:
+	case ECHODEV_LINK:
+	case ECHODEV_GLINK:
+	case ECHODEV_GSTATS:
+	case ECHODEV_GHIST:
+	case ECHODEV_GOCCUPANCY:
+	case FIONREAD:
+		return (ef->rsc);
+	default:
+		return (ef->wsc);
 	}
-	sx_xunlock(&sc->lock);
-	return (error);
 }
 
 static int
 echo_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
     struct thread *td)
 {
-	struct echodev_softc *sc = dev->si_drv1;
+	struct echodev_softc *sc;
+	struct echodev_file *ef;
 	int error;
 
+	sc = echo_ioctl_softc(dev, cmd);
+	SDT_PROBE3(echodev, , ioctl, entry, sc, cmd, fflag);
 	switch (cmd) {
 	case ECHODEV_GBUFSIZE:
-		sx_slock(&sc->lock);
+		echo_slock(sc, LS_IOCTL);
 		*(size_t *)data = sc->len;
 		sx_sunlock(&sc->lock);
 		error = 0;
 		break;
 	case ECHODEV_SBUFSIZE:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_resize(sc, *(size_t *)data, fflag);
+		break;
+	case ECHODEV_CLEAR:
 	{
-		size_t new_len;
+		struct echodev_records list;
 
 		if ((fflag & FWRITE) == 0) {
 			error = EPERM;
 			break;
 		}
 
+		STAILQ_INIT(&list);
+		echo_xlock(sc, LS_IOCTL);
+
+		/* Wait for any splice in flight to finish. */
 		error = 0;
-		new_len = *(size_t *)data;
-		sx_xlock(&sc->lock);
-		if (new_len == sc->len) {
-			/* Nothing to do. */
-		} else if (new_len < sc->len) {
-			if (new_len < sc->valid)
-				error = EBUSY;
-			else
-				sc->len = new_len;
-		} else {
-			/* Wakeup any waiting writers. */
-			if (sc->valid == sc->len)
-				wakeup(sc);
+		while (sc->splice_busy) {
+			error = echo_sx_sleep(sc, "echocl");
+			if (error != 0)
+				break;
+		}
+		if (error != 0) {
+			echo_xunlock(sc);
+			break;
+		}
+
+		echo_records_flush(sc, &list);
+
+		/* Wakeup any waiting writers or pending resize. */
+		if (echo_space(sc) == 0 || sc->resizing)
+			echo_wakeup(sc);
+
+		/* Report the buffered and pending direct bytes discarded. */
+		SDT_PROBE2(echodev, , , clear, sc,
+		    sc->valid + sc->direct_len);
+		echo_trace(sc, ECHODEV_TRACE_CLEAR,
+		    sc->valid + sc->direct_len);
 
-			sc->buf = reallocf(sc->buf, new_len, M_ECHODEV,
-			    M_WAITOK | M_ZERO);
-			sc->len = new_len;
-			selwakeup(&sc->wsel);
-			KNOTE_LOCKED(&sc->wsel.si_note, 0);
+		/* Discard any pending direct write. */
+		if (sc->direct_len != 0) {
+			sc->direct_len = 0;
+			echo_wakeup(sc);
 		}
-		sx_xunlock(&sc->lock);
+
+		sc->valid = 0;
+		echo_count(sc, ES_CLEARS, 1);
+		echo_notify_write(sc);
+		echo_xunlock(sc);
+		echo_records_free(&list);
 		break;
 	}
-	case ECHODEV_CLEAR:
+	case ECHODEV_GRING:
+		echo_slock(sc, LS_IOCTL);
+		*(size_t *)data = sc->ring != NULL ? sc->ring->size : 0;
+		sx_sunlock(&sc->lock);
+		error = 0;
+		break;
+	case ECHODEV_SRING:
 		if ((fflag & FWRITE) == 0) {
 			error = EPERM;
 			break;
 		}
 
-		sx_xlock(&sc->lock);
+		/* Both ends of a pair would need to map each direction. */
+		if (echo_file_paired()) {
+			error = EINVAL;
+			break;
+		}
+		error = echo_set_ring(sc, *(size_t *)data);
+		break;
+	case ECHODEV_RING_WAKE:
+	{
+		uint32_t flags;
 
-		/* Wakeup any waiting writers. */
-		if (sc->valid == sc->len)
-			wakeup(sc);
+		echo_xlock(sc, LS_IOCTL);
+		if (sc->ring == NULL) {
+			echo_xunlock(sc);
+			error = EINVAL;
+			break;
+		}
 
-		sc->valid = 0;
-		selwakeup(&sc->wsel);
-		KNOTE_LOCKED(&sc->wsel.si_note, 0);
-		sx_xunlock(&sc->lock);
+		flags = atomic_readandclear_32(&sc->ring->hdr->er_flags);
+		if ((flags & ECHODEV_RING_RWAIT) != 0) {
+			echo_notify_read(sc);
+		}
+		if ((flags & ECHODEV_RING_WWAIT) != 0) {
+			echo_notify_write(sc);
+		}
+		echo_xunlock(sc);
+		error = 0;
+		break;
+	}
+	case ECHODEV_GBLOCKS:
+	{
+		struct echodev_blocks *eb = (struct echodev_blocks *)data;
+
+		echo_slock(sc, LS_IOCTL);
+		if (sc->blocks != NULL) {
+			eb->eb_count = sc->blocks->count;
+			eb->eb_size = sc->blocks->size;
+		} else {
+			eb->eb_count = 0;
+			eb->eb_size = 0;
+		}
+		sx_sunlock(&sc->lock);
+		error = 0;
+		break;
+	}
+	case ECHODEV_SBLOCKS:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		if (echo_file_paired()) {
+			error = EINVAL;
+			break;
+		}
+		error = echo_set_blocks(sc, (struct echodev_blocks *)data);
+		break;
+	case ECHODEV_BSWAP:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_block_swap(sc, (struct echodev_swap *)data, fflag);
+		break;
+	case ECHODEV_BRELEASE:
+		error = echo_block_release(sc, (struct echodev_swap *)data,
+		    fflag);
+		break;
+	case ECHODEV_GLOAN:
+		echo_slock(sc, LS_IOCTL);
+		*(int *)data = sc->loan;
+		sx_sunlock(&sc->lock);
+		error = 0;
+		break;
+	case ECHODEV_SLOAN:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		echo_xlock(sc, LS_IOCTL);
+		sc->loan = *(int *)data != 0;
+		echo_xunlock(sc);
+		error = 0;
+		break;
+	case ECHODEV_GRECORDS:
+		echo_slock(sc, LS_IOCTL);
+		*(int *)data = sc->record_mode;
+		sx_sunlock(&sc->lock);
+		error = 0;
+		break;
+	case ECHODEV_SRECORDS:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_set_records(sc, *(int *)data != 0);
+		break;
+	case ECHODEV_SENDREF:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_send_ref(sc, (struct echodev_ref *)data, fflag,
+		    td);
+		break;
+	case ECHODEV_RECV:
+		error = echo_recv(sc, (struct echodev_recv *)data, fflag, td);
+		break;
+	case ECHODEV_SPLICE_OUT:
+		if ((fflag & FREAD) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_splice_out(sc, (struct echodev_splice *)data,
+		    fflag, td);
+		break;
+	case ECHODEV_SPLICE_IN:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_splice_in(sc, (struct echodev_splice *)data,
+		    fflag, td);
+		break;
+	case ECHODEV_LINK:
+		if ((fflag & FWRITE) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = echo_link(sc, *(int *)data);
+		break;
+	case ECHODEV_GLINK:
+		echo_link_stats(sc, (struct echodev_link_stats *)data);
 		error = 0;
 		break;
 	case FIONBIO:
@@ -262,21 +3468,93 @@ echo_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 		error = 0;
 		break;
 	case FIOASYNC:
-		/* O_ASYNC is not supported. */
-		if (*(int *)data != 0)
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error != 0)
+			break;
+
+		/* O_ASYNC is not supported for aggregators. */
+		if (ef->agg != NULL) {
+			if (*(int *)data != 0)
+				error = EINVAL;
+			break;
+		}
+		echo_set_async(ef, *(int *)data != 0);
+		break;
+	case FIOSETOWN:
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0)
+			error = fsetown(*(int *)data, &ef->sigio);
+		break;
+	case FIOGETOWN:
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0)
+			*(int *)data = fgetown(&ef->sigio);
+		break;
+	case ECHODEV_PAIR:
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0 && ef->agg != NULL)
+			error = EBUSY;
+		if (error == 0)
+			error = echo_pair(sc, ef, *(int *)data, fflag);
+		break;
+	case ECHODEV_GSTATS:
+		echo_stats(sc, (struct echodev_stats *)data);
+		error = 0;
+		break;
+	case ECHODEV_GHIST:
+	{
+		struct echodev_hist *eh = (struct echodev_hist *)data;
+
+		if (eh->eh_which < 0 || eh->eh_which >= ECHODEV_HIST_COUNT) {
 			error = EINVAL;
-		else
-			error = 0;
+			break;
+		}
+		echo_hist_fetch(sc, eh->eh_which, eh->eh_buckets);
+		error = 0;
+		break;
+	}
+	case ECHODEV_GOCCUPANCY:
+		echo_xlock(sc, LS_IOCTL);
+		echo_occupancy(sc, (struct echodev_occupancy *)data);
+		echo_xunlock(sc);
+		error = 0;
+		break;
+	case ECHODEV_AIOFD:
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0)
+			error = echo_aio_fd(ef, fflag, (int *)data, td);
+		break;
+	case ECHODEV_SUBSCRIBE:
+		if ((fflag & FREAD) == 0) {
+			error = EPERM;
+			break;
+		}
+
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0)
+			error = echo_subscribe(ef, *(int *)data);
+		break;
+	case ECHODEV_UNSUBSCRIBE:
+		error = devfs_get_cdevpriv((void **)&ef);
+		if (error == 0)
+			error = echo_unsubscribe(ef, *(int *)data);
 		break;
 	case FIONREAD:
-		sx_slock(&sc->lock);
-		*(int *)data = MIN(INT_MAX, sc->valid);
+		echo_slock(sc, LS_IOCTL);
+		if (sc->blocks != NULL && sc->blocks->filled_count != 0)
+			*(int *)data = MIN(INT_MAX, sc->blocks->lens[
+			    sc->blocks->filledq[sc->blocks->filled_head]]);
+		else if (sc->record_mode && sc->nrecords != 0)
+			*(int *)data = MIN(INT_MAX,
+			    STAILQ_FIRST(&sc->records)->len);
+		else
+			*(int *)data = MIN(INT_MAX, echo_valid(sc));
 		sx_sunlock(&sc->lock);
 		error = 0;
 		break;
 	case FIONWRITE:
-		sx_slock(&sc->lock);
-		*(int *)data = MIN(INT_MAX, sc->len - sc->valid);
+		echo_slock(sc, LS_IOCTL);
+		*(int *)data = MIN(INT_MAX, echo_space(sc));
 		sx_sunlock(&sc->lock);
 		error = 0;
 		break;
@@ -284,21 +3562,41 @@ echo_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 		error = ENOTTY;
 		break;
 	}
+	SDT_PROBE3(echodev, , ioctl, return, sc, cmd, error);
 	return (error);
 }
 
 static int
-echo_poll(struct cdev *dev, int events, struct thread *td)
+echo_poll_events(struct echodev_softc *sc, int events)
 {
-	struct echodev_softc *sc = dev->si_drv1;
 	int revents;
 
 	revents = 0;
-	sx_slock(&sc->lock);
-	if (sc->valid != 0 || sc->writers == 0)
+	if (echo_valid(sc) != 0 || sc->writers == 0)
 		revents |= events & (POLLIN | POLLRDNORM);
-	if (sc->valid < sc->len)
+	if (echo_space(sc) != 0)
 		revents |= events & (POLLOUT | POLLWRNORM);
+	return (revents);
+}
+
+static int
+echo_poll_one(struct echodev_softc *sc, int events, struct thread *td)
+{
+	uint32_t flags;
+	int revents;
+
+	echo_slock(sc, LS_POLL);
+	revents = echo_poll_events(sc, events);
+	if (revents == 0 && sc->ring != NULL) {
+		/* Ask the other side of the ring to wake us. */
+		flags = 0;
+		if ((events & (POLLIN | POLLRDNORM)) != 0)
+			flags |= ECHODEV_RING_RWAIT;
+		if ((events & (POLLOUT | POLLWRNORM)) != 0)
+			flags |= ECHODEV_RING_WWAIT;
+		echo_ring_arm(sc->ring, flags);
+		revents = echo_poll_events(sc, events);
+	}
 	if (revents == 0) {
 		if ((events & (POLLIN | POLLRDNORM)) != 0)
 			selrecord(td, &sc->rsel);
@@ -309,18 +3607,66 @@ echo_poll(struct cdev *dev, int events, struct thread *td)
 	return (revents);
 }
 
+static int
+echo_poll_agg(struct echodev_agg *agg, int events, struct thread *td)
+{
+	int revents;
+
+	revents = 0;
+	mtx_lock(&agg->mtx);
+	if (agg->nready != 0)
+		revents |= events & (POLLIN | POLLRDNORM);
+	else if ((events & (POLLIN | POLLRDNORM)) != 0)
+		selrecord(td, &agg->sel);
+	mtx_unlock(&agg->mtx);
+	return (revents);
+}
+
+static int
+echo_poll(struct cdev *dev, int events, struct thread *td)
+{
+	struct echodev_file *ef;
+
+	if (devfs_get_cdevpriv((void **)&ef) != 0)
+		return (events & (POLLHUP | POLLIN | POLLRDNORM | POLLOUT |
+		    POLLWRNORM));
+	if (ef->agg != NULL)
+		return (echo_poll_agg(ef->agg, events, td));
+	if (ef->rsc == ef->wsc)
+		return (echo_poll_one(ef->rsc, events, td));
+	return (echo_poll_one(ef->rsc, events & (POLLIN | POLLRDNORM), td) |
+	    echo_poll_one(ef->wsc, events & (POLLOUT | POLLWRNORM), td));
+}
+
 static int
 echo_kqfilter(struct cdev *dev, struct knote *kn)
 {
-	struct echodev_softc *sc = dev->si_drv1;
+	struct echodev_file *ef;
+	struct echodev_softc *sc;
+	int error;
+
+	error = devfs_get_cdevpriv((void **)&ef);
+	if (error != 0)
+		return (error);
+
+	if (ef->agg != NULL) {
+		if (kn->kn_filter != EVFILT_READ)
+			return (EINVAL);
+		kn->kn_fop = &echo_agg_filterops;
+		kn->kn_hook = ef->agg;
+		knlist_add(&ef->agg->sel.si_note, kn, 0);
+		return (0);
+	}
 
 	switch (kn->kn_filter) {
 	case EVFILT_READ:
+		sc = ef->rsc;
 		kn->kn_fop = &echo_read_filterops;
 		kn->kn_hook = sc;
 		knlist_add(&sc->rsel.si_note, kn, 0);
 		return (0);
 	case EVFILT_WRITE:
+		sc = ef->wsc;
 		kn->kn_fop = &echo_write_filterops;
 		kn->kn_hook = sc;
 		knlist_add(&sc->wsel.si_note, kn, 0);
@@ -343,12 +3689,16 @@ echo_kqread_event(struct knote *kn, long hint)
 {
 	struct echodev_softc *sc = kn->kn_hook;
 
-	kn->kn_data = sc->valid;
+	kn->kn_data = echo_valid(sc);
 	if (sc->writers == 0) {
 		kn->kn_flags |= EV_EOF;
 		return (1);
 	}
 	kn->kn_flags &= ~EV_EOF;
+	if (kn->kn_data == 0 && sc->ring != NULL) {
+		echo_ring_arm(sc->ring, ECHODEV_RING_RWAIT);
+		kn->kn_data = echo_valid(sc);
+	}
 	return (kn->kn_data > 0);
 }
 
@@ -365,16 +3715,353 @@ echo_kqwrite_event(struct knote *kn, long hint)
 {
 	struct echodev_softc *sc = kn->kn_hook;
 
-	kn->kn_data = sc->len - sc->valid;
+	kn->kn_data = echo_space(sc);
+	if (kn->kn_data == 0 && sc->ring != NULL) {
+		echo_ring_arm(sc->ring, ECHODEV_RING_WWAIT);
+		kn->kn_data = echo_space(sc);
+	}
+	return (kn->kn_data > 0);
+}
+
+static void
+echo_kqagg_detach(struct knote *kn)
+{
+	struct echodev_agg *agg = kn->kn_hook;
+
+	knlist_remove(&agg->sel.si_note, kn, 0);
+}
+
+static int
+echo_kqagg_event(struct knote *kn, long hint)
+{
+	struct echodev_agg *agg = kn->kn_hook;
+
+	kn->kn_data = agg->nready;
 	return (kn->kn_data > 0);
 }
 
+static int
+echo_status_ticks(void)
+{
+	return (MAX(1, (int64_t)echo_status_interval * hz / 1000));
+}
+
+/*
+ * Refresh the statistics in the status page.  Refreshes stop once
+ * the page is no longer mapped and resume when it is mapped again.
+ */
+static void
+echo_status_task(void *arg, int pending __unused)
+{
+	struct echodev_softc *sc = arg;
+	struct echodev_status *st;
+	struct echodev_stats es;
+
+	echo_stats(sc, &es);
+	echo_xlock(sc, LS_POLL);
+	st = sc->status;
+	echo_status_begin(st);
+	st->es_stats = es;
+	st->es_stats_time = sbttons(sbinuptime());
+	echo_status_end(st);
+	if (!sc->dying && refcount_load(&sc->status_obj->ref_count) > 1)
+		taskqueue_enqueue_timeout(taskqueue_thread, &sc->status_task,
+		    echo_status_ticks());
+	else
+		sc->status_armed = false;
+	echo_xunlock(sc);
+}
+
+/*
+ * Allocate the status page on first use.  Like a shared ring, the
+ * page is wired and mapped into the kernel so it can be updated while
+ * holding the instance lock.
+ */
+static int
+echo_status_alloc(struct echodev_softc *sc)
+{
+	vm_offset_t kva;
+	vm_object_t obj;
+	vm_page_t m;
+
+	sx_assert(&sc->lock, SA_XLOCKED);
+	obj = vm_pager_allocate(OBJT_SWAP, NULL, PAGE_SIZE, VM_PROT_DEFAULT,
+	    0, NULL);
+	if (obj == NULL)
+		return (ENOMEM);
+	kva = kva_alloc(PAGE_SIZE);
+	if (kva == 0) {
+		vm_object_deallocate(obj);
+		return (ENOMEM);
+	}
+	VM_OBJECT_WLOCK(obj);
+	m = vm_page_grab(obj, 0, VM_ALLOC_NORMAL | VM_ALLOC_WIRED |
+	    VM_ALLOC_ZERO);
+	vm_page_valid(m);
+	vm_page_xunbusy(m);
+	VM_OBJECT_WUNLOCK(obj);
+	pmap_qenter(kva, &m, 1);
+
+	sc->status_obj = obj;
+	sc->status_page = m;
+	sc->status = (struct echodev_status *)kva;
+	echo_stats(sc, &sc->status->es_stats);
+	sc->status->es_stats_time = sbttons(sbinuptime());
+	echo_status_update(sc);
+	return (0);
+}
+
+static void
+echo_status_free(struct echodev_softc *sc)
+{
+	pmap_qremove((vm_offset_t)sc->status, 1);
+	kva_free((vm_offset_t)sc->status, PAGE_SIZE);
+	vm_page_unwire(sc->status_page, PQ_ACTIVE);
+	vm_object_deallocate(sc->status_obj);
+}
+
+/*
+ * Map the status page read-only.  Descriptors opened for writing are
+ * refused since their mappings could later be made writable.
+ */
+static int
+echo_mmap_status(struct echodev_softc *sc, vm_ooffset_t *offset,
+    vm_size_t size, struct vm_object **object, int nprot)
+{
+	struct echodev_file *ef;
+	int error;
+
+	error = devfs_get_cdevpriv((void **)&ef);
+	if (error != 0)
+		return (error);
+	if ((nprot & VM_PROT_WRITE) != 0 || (ef->fflag & FWRITE) != 0)
+		return (EACCES);
+	if (*offset != ECHODEV_STATUS_OFFSET || size > PAGE_SIZE)
+		return (EINVAL);
+	echo_xlock(sc, LS_IOCTL);
+	if (sc->dying) {
+		echo_xunlock(sc);
+		return (ENXIO);
+	}
+	if (sc->status == NULL) {
+		error = echo_status_alloc(sc);
+		if (error != 0) {
+			echo_xunlock(sc);
+			return (error);
+		}
+	}
+	vm_object_reference(sc->status_obj);
+	*object = sc->status_obj;
+	*offset = 0;
+	if (!sc->status_armed) {
+		sc->status_armed = true;
+		taskqueue_enqueue_timeout(taskqueue_thread, &sc->status_task,
+		    echo_status_ticks());
+	}
+	echo_xunlock(sc);
+	return (0);
+}
+
+static int
+echo_mmap_single(struct cdev *dev, vm_ooffset_t *offset, vm_size_t size,
+    struct vm_object **object, int nprot)
+{
+	struct echodev_softc *sc = dev->si_drv1;
+	vm_object_t obj;
+	size_t mapsize;
+
+	if (*offset >= ECHODEV_STATUS_OFFSET)
+		return (echo_mmap_status(sc, offset, size, object, nprot));
+	if (echo_file_paired())
+		return (EINVAL);
+
+	echo_slock(sc, LS_IOCTL);
+	if (sc->ring != NULL) {
+		obj = sc->ring->obj;
+		mapsize = sc->ring->mapsize;
+	} else if (sc->blocks != NULL) {
+		obj = sc->blocks->obj;
+		mapsize = sc->blocks->count * sc->blocks->size;
+	} else {
+		sx_sunlock(&sc->lock);
+		return (EINVAL);
+	}
+	if (*offset > mapsize || size > mapsize - *offset) {
+		sx_sunlock(&sc->lock);
+		return (EINVAL);
+	}
+	vm_object_reference(obj);
+	*object = obj;
+	sx_sunlock(&sc->lock);
+	return (0);
+}
+
+/*
+ * Kernel producer and consumer interface.  Requests are performed as
+ * kernel-space I/O through the same paths as read(2) and write(2).
+ */
+static struct echodev_softc *
+echo_kpi_softc(int unit)
+{
+	if (echo_softcs == NULL || unit < 0 || (u_int)unit >= echo_units)
+		return (NULL);
+	return (echo_softcs[unit]);
+}
+
+static int
+echo_kpi_rdwr(struct echodev_softc *sc, void *buf, size_t len,
+    enum uio_rw rw, int ioflag, size_t *donep)
+{
+	struct echodev_file ef;
+	struct iovec iov;
+	struct uio uio;
+	int error;
+
+	memset(&ef, 0, sizeof(ef));
+	ef.rsc = sc;
+	ef.wsc = sc;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	uio.uio_iov = &iov;
+	uio.uio_iovcnt = 1;
+	uio.uio_offset = 0;
+	uio.uio_resid = len;
+	uio.uio_segflg = UIO_SYSSPACE;
+	uio.uio_rw = rw;
+	uio.uio_td = curthread;
+	if (rw == UIO_READ)
+		error = echo_read_file(&ef, &uio, ioflag);
+	else
+		error = echo_write_file(&ef, &uio, ioflag);
+	if (donep != NULL)
+		*donep = len - uio.uio_resid;
+	return (error);
+}
+
+int
+echodev_enqueue(int unit, const void *buf, size_t len, int flags,
+    size_t *donep)
+{
+	struct echodev_softc *sc;
+
+	sc = echo_kpi_softc(unit);
+	if (sc == NULL)
+		return (ENXIO);
+	return (echo_kpi_rdwr(sc, __DECONST(void *, buf), len, UIO_WRITE,
+	    (flags & ECHODEV_NOWAIT) != 0 ? O_NONBLOCK : 0, donep));
+}
+
+int
+echodev_dequeue(int unit, void *buf, size_t len, int flags, size_t *donep)
+{
+	struct echodev_softc *sc;
+
+	sc = echo_kpi_softc(unit);
+	if (sc == NULL)
+		return (ENXIO);
+	return (echo_kpi_rdwr(sc, buf, len, UIO_READ,
+	    (flags & ECHODEV_NOWAIT) != 0 ? O_NONBLOCK : 0, donep));
+}
+
+int
+echodev_producer_register(int unit)
+{
+	struct echodev_softc *sc;
+
+	sc = echo_kpi_softc(unit);
+	if (sc == NULL)
+		return (ENXIO);
+	return (echo_add_writer(sc));
+}
+
+void
+echodev_producer_deregister(int unit)
+{
+	struct echodev_softc *sc;
+
+	sc = echo_kpi_softc(unit);
+	KASSERT(sc != NULL, ("%s: invalid unit %d", __func__, unit));
+	echo_drop_writer(sc);
+}
+
+int
+echodev_enqueue_nosleep(int unit, const void *buf, size_t len)
+{
+	struct echodev_softc *sc;
+	struct echodev_kbuf *kb;
+
+	sc = echo_kpi_softc(unit);
+	if (sc == NULL)
+		return (ENXIO);
+	if (len == 0)
+		return (0);
+
+	kb = malloc(sizeof(*kb) + len, M_ECHODEV, M_NOWAIT);
+	if (kb == NULL)
+		return (ENOBUFS);
+	kb->len = len;
+	kb->off = 0;
+	memcpy(kb->data, buf, len);
+
+	mtx_lock(&sc->kpi_mtx);
+	if (sc->kpi_staged + len > ECHO_KPI_STAGE_MAX) {
+		mtx_unlock(&sc->kpi_mtx);
+		free(kb, M_ECHODEV);
+		return (ENOBUFS);
+	}
+	STAILQ_INSERT_TAIL(&sc->kpi_bufs, kb, link);
+	sc->kpi_staged += len;
+	mtx_unlock(&sc->kpi_mtx);
+	taskqueue_enqueue(taskqueue_thread, &sc->kpi_task);
+	return (0);
+}
+
+/*
+ * Move staged data into the instance until it is full.  The task is
+ * queued again when space is freed.  Only this task removes staged
+ * buffers, so the head can be used without holding the mutex.
+ */
+static void
+echo_kpi_task(void *arg, int pending)
+{
+	struct echodev_softc *sc = arg;
+	struct echodev_kbuf *kb;
+	size_t done;
+	int error;
+
+	for (;;) {
+		mtx_lock(&sc->kpi_mtx);
+		kb = STAILQ_FIRST(&sc->kpi_bufs);
+		mtx_unlock(&sc->kpi_mtx);
+		if (kb == NULL)
+			return;
+
+		error = echo_kpi_rdwr(sc, kb->data + kb->off,
+		    kb->len - kb->off, UIO_WRITE, O_NONBLOCK, &done);
+		kb->off += done;
+		if (error == EWOULDBLOCK)
+			error = 0;
+		mtx_lock(&sc->kpi_mtx);
+		sc->kpi_staged -= done;
+		if (error != 0 || kb->off == kb->len) {
+			/* Staged data is dropped if the instance fails. */
+			sc->kpi_staged -= kb->len - kb->off;
+			STAILQ_REMOVE_HEAD(&sc->kpi_bufs, link);
+			mtx_unlock(&sc->kpi_mtx);
+			free(kb, M_ECHODEV);
+			continue;
+		}
+		mtx_unlock(&sc->kpi_mtx);
+		return;
+	}
+}
+
 static void
 echo_kn_lock(void *arg)
 {
 	struct sx *sx = arg;
 
-	sx_xlock(sx);
+	echo_xlock(__containerof(sx, struct echodev_softc, lock), LS_KNOTE);
 }
 
 static void
@@ -382,7 +4069,7 @@ echo_kn_unlock(void *arg)
 {
 	struct sx *sx = arg;
 
-	sx_xunlock(sx);
+	echo_xunlock(__containerof(sx, struct echodev_softc, lock));
 }
 
 static void
@@ -400,19 +4087,241 @@ echo_knlist_init(struct knlist *knl, struct echodev_softc *sc)
 	    echo_kn_assert_lock);
 }
 
-static int
-echodev_create(struct echodev_softc **scp, size_t len)
+static struct echodev_softc *
+echodev_alloc(int unit, size_t len)
 {
-	struct make_dev_args args;
 	struct echodev_softc *sc;
-	int error;
+	int i;
 
 	sc = malloc(sizeof(*sc), M_ECHODEV, M_WAITOK | M_ZERO);
 	sx_init(&sc->lock, "echo");
 	echo_knlist_init(&sc->rsel.si_note, sc);
 	echo_knlist_init(&sc->wsel.si_note, sc);
+	STAILQ_INIT(&sc->records);
+	TAILQ_INIT(&sc->in_links);
+	LIST_INIT(&sc->rasync);
+	LIST_INIT(&sc->wasync);
+	TAILQ_INIT(&sc->subs);
+	TAILQ_INIT(&sc->aio_rjobs);
+	TAILQ_INIT(&sc->aio_wjobs);
+	mtx_init(&sc->kpi_mtx, "echo kpi", NULL, MTX_DEF);
+	STAILQ_INIT(&sc->kpi_bufs);
+	TASK_INIT(&sc->kpi_task, 0, echo_kpi_task, sc);
+	TIMEOUT_TASK_INIT(taskqueue_thread, &sc->status_task, 0,
+	    echo_status_task, sc);
+	COUNTER_ARRAY_ALLOC(sc->stats, ES_NSTATS, M_WAITOK);
+	for (i = 0; i < ECHODEV_HIST_COUNT; i++)
+		COUNTER_ARRAY_ALLOC(sc->hist[i], ECHODEV_HIST_BUCKETS,
+		    M_WAITOK);
+	LIST_INIT(&sc->sleepers);
+	sc->occ.last_time = sbinuptime();
+	for (i = 0; i < LS_COUNT; i++) {
+		sc->lockprof[i].acquires = counter_u64_alloc(M_WAITOK);
+		sc->lockprof[i].contended = counter_u64_alloc(M_WAITOK);
+		sc->lockprof[i].wait_ns = counter_u64_alloc(M_WAITOK);
+	}
+	sysctl_ctx_init(&sc->sysctl_ctx);
+	sc->unit = unit;
 	sc->buf = malloc(len, M_ECHODEV, M_WAITOK | M_ZERO);
 	sc->len = len;
+	return (sc);
+}
+
+static void
+echodev_free(struct echodev_softc *sc)
+{
+	struct echodev_kbuf *kb;
+	int i;
+
+	taskqueue_drain(taskqueue_thread, &sc->kpi_task);
+	if (sc->status != NULL) {
+		taskqueue_drain_timeout(taskqueue_thread, &sc->status_task);
+		echo_status_free(sc);
+	}
+	while ((kb = STAILQ_FIRST(&sc->kpi_bufs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&sc->kpi_bufs, link);
+		free(kb, M_ECHODEV);
+	}
+	mtx_destroy(&sc->kpi_mtx);
+	sysctl_ctx_free(&sc->sysctl_ctx);
+	COUNTER_ARRAY_FREE(sc->stats, ES_NSTATS);
+	for (i = 0; i < ECHODEV_HIST_COUNT; i++)
+		COUNTER_ARRAY_FREE(sc->hist[i], ECHODEV_HIST_BUCKETS);
+	for (i = 0; i < LS_COUNT; i++) {
+		counter_u64_free(sc->lockprof[i].acquires);
+		counter_u64_free(sc->lockprof[i].contended);
+		counter_u64_free(sc->lockprof[i].wait_ns);
+	}
+	knlist_destroy(&sc->rsel.si_note);
+	knlist_destroy(&sc->wsel.si_note);
+	seldrain(&sc->rsel);
+	seldrain(&sc->wsel);
+	if (sc->ring != NULL)
+		echo_ring_free(sc->ring);
+	if (sc->blocks != NULL)
+		echo_blocks_free(sc->blocks);
+	echo_records_free(&sc->records);
+	free(sc->buf, M_ECHODEV);
+	sx_destroy(&sc->lock);
+	free(sc, M_ECHODEV);
+}
+
+static int
+echo_sysctl_hist(SYSCTL_HANDLER_ARGS)
+{
+	struct echodev_softc *sc = arg1;
+	uint64_t *buckets;
+	int error;
+
+	buckets = mallocarray(ECHODEV_HIST_BUCKETS, sizeof(*buckets),
+	    M_ECHODEV, M_WAITOK);
+	echo_hist_fetch(sc, arg2, buckets);
+	error = SYSCTL_OUT(req, buckets, ECHODEV_HIST_BUCKETS *
+	    sizeof(*buckets));
+	free(buckets, M_ECHODEV);
+	return (error);
+}
+
+static int
+echo_sysctl_lock_reset(SYSCTL_HANDLER_ARGS)
+{
+	struct echodev_softc *sc = arg1;
+	struct echodev_lockprof *lp;
+	int error, i, val;
+
+	val = 0;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL || val == 0)
+		return (error);
+
+	echo_xlock(sc, LS_IOCTL);
+	for (i = 0; i < LS_COUNT; i++) {
+		lp = &sc->lockprof[i];
+		counter_u64_zero(lp->acquires);
+		counter_u64_zero(lp->contended);
+		counter_u64_zero(lp->wait_ns);
+		lp->max_hold_ns = 0;
+	}
+	echo_xunlock(sc);
+	return (0);
+}
+
+/* Report one field of struct echodev_occupancy given by arg2. */
+static int
+echo_sysctl_occupancy(SYSCTL_HANDLER_ARGS)
+{
+	struct echodev_softc *sc = arg1;
+	struct echodev_occupancy eo;
+	uint64_t val;
+
+	echo_xlock(sc, LS_IOCTL);
+	echo_occupancy(sc, &eo);
+	echo_xunlock(sc);
+	val = *(uint64_t *)((char *)&eo + arg2);
+	return (sysctl_handle_64(oidp, &val, 0, req));
+}
+
+/* Export per-instance state under dev.echo.<unit>. */
+static void
+echodev_sysctl_init(struct echodev_softc *sc)
+{
+	static const char *hist_names[ECHODEV_HIST_COUNT] = {
+		"read", "write", "sleep", "wakeup"
+	};
+	static const char *site_names[LS_COUNT] = {
+		"read", "write", "poll", "ioctl", "knote"
+	};
+	static const struct {
+		const char *name;
+		size_t offset;
+		const char *descr;
+	} occ_fields[] = {
+		{ "hwm", offsetof(struct echodev_occupancy, eo_hwm),
+		  "Highest occupancy in bytes" },
+		{ "total_ns", offsetof(struct echodev_occupancy, eo_total_ns),
+		  "Nanoseconds tracked" },
+		{ "full_ns", offsetof(struct echodev_occupancy, eo_full_ns),
+		  "Nanoseconds spent full" },
+		{ "empty_ns", offsetof(struct echodev_occupancy, eo_empty_ns),
+		  "Nanoseconds spent empty" },
+		{ "age_ns", offsetof(struct echodev_occupancy, eo_age_ns),
+		  "Age of the oldest unread byte in nanoseconds" },
+		{ "max_age_ns", offsetof(struct echodev_occupancy,
+		  eo_max_age_ns), "Largest age of an unread byte" },
+	};
+	struct echodev_lockprof *lp;
+	struct sysctl_oid *oid, *site_oid, *unit_oid;
+	struct sysctl_oid_list *children;
+	char name[16];
+	int i;
+
+	snprintf(name, sizeof(name), "%d", sc->unit);
+	unit_oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx,
+	    SYSCTL_STATIC_CHILDREN(_dev_echo), OID_AUTO, name,
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, "Echo instance");
+	oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx, SYSCTL_CHILDREN(unit_oid),
+	    OID_AUTO, "stats", CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, "Statistics");
+	children = SYSCTL_CHILDREN(oid);
+	for (i = 0; i < ES_NSTATS; i++)
+		SYSCTL_ADD_COUNTER_U64(&sc->sysctl_ctx, children, OID_AUTO,
+		    echo_stat_info[i].name, CTLFLAG_RD, &sc->stats[i],
+		    echo_stat_info[i].descr);
+
+	oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx, SYSCTL_CHILDREN(unit_oid),
+	    OID_AUTO, "latency", CTLFLAG_RD | CTLFLAG_MPSAFE, NULL,
+	    "Latency histograms in nanoseconds");
+	children = SYSCTL_CHILDREN(oid);
+	for (i = 0; i < ECHODEV_HIST_COUNT; i++)
+		SYSCTL_ADD_PROC(&sc->sysctl_ctx, children, OID_AUTO,
+		    hist_names[i], CTLTYPE_OPAQUE | CTLFLAG_RD |
+		    CTLFLAG_MPSAFE, sc, i, echo_sysctl_hist, "QU",
+		    "Histogram buckets");
+
+	oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx, SYSCTL_CHILDREN(unit_oid),
+	    OID_AUTO, "occupancy", CTLFLAG_RD | CTLFLAG_MPSAFE, NULL,
+	    "Buffer occupancy since the last resize");
+	children = SYSCTL_CHILDREN(oid);
+	for (i = 0; i < nitems(occ_fields); i++)
+		SYSCTL_ADD_PROC(&sc->sysctl_ctx, children, OID_AUTO,
+		    occ_fields[i].name, CTLTYPE_U64 | CTLFLAG_RD |
+		    CTLFLAG_MPSAFE, sc, occ_fields[i].offset,
+		    echo_sysctl_occupancy, "QU", occ_fields[i].descr);
+
+	oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx, SYSCTL_CHILDREN(unit_oid),
+	    OID_AUTO, "lock", CTLFLAG_RD | CTLFLAG_MPSAFE, NULL,
+	    "Lock profiling (see hw.echo.lock_profiling)");
+	children = SYSCTL_CHILDREN(oid);
+	SYSCTL_ADD_PROC(&sc->sysctl_ctx, children, OID_AUTO, "reset",
+	    CTLTYPE_INT | CTLFLAG_WR | CTLFLAG_MPSAFE, sc, 0,
+	    echo_sysctl_lock_reset, "I", "Reset lock profiling");
+	for (i = 0; i < LS_COUNT; i++) {
+		lp = &sc->lockprof[i];
+		site_oid = SYSCTL_ADD_NODE(&sc->sysctl_ctx, children, OID_AUTO,
+		    site_names[i], CTLFLAG_RD | CTLFLAG_MPSAFE, NULL,
+		    "Lock profile for a class of callers");
+		SYSCTL_ADD_COUNTER_U64(&sc->sysctl_ctx,
+		    SYSCTL_CHILDREN(site_oid), OID_AUTO, "acquires", CTLFLAG_RD,
+		    &lp->acquires, "Lock acquisitions");
+		SYSCTL_ADD_COUNTER_U64(&sc->sysctl_ctx,
+		    SYSCTL_CHILDREN(site_oid), OID_AUTO, "contended",
+		    CTLFLAG_RD, &lp->contended, "Contended acquisitions");
+		SYSCTL_ADD_COUNTER_U64(&sc->sysctl_ctx,
+		    SYSCTL_CHILDREN(site_oid), OID_AUTO, "wait_ns", CTLFLAG_RD,
+		    &lp->wait_ns, "Nanoseconds spent waiting for the lock");
+		SYSCTL_ADD_U64(&sc->sysctl_ctx, SYSCTL_CHILDREN(site_oid),
+		    OID_AUTO, "max_hold_ns", CTLFLAG_RD, &lp->max_hold_ns, 0,
+		    "Longest exclusive hold in nanoseconds");
+	}
+}
+
+static int
+echodev_create(struct echodev_softc **scp, int unit, size_t len)
+{
+	struct make_dev_args args;
+	struct echodev_softc *sc;
+	int error;
+
+	sc = echodev_alloc(unit, len);
 	make_dev_args_init(&args);
 	args.mda_flags = MAKEDEV_WAITOK | MAKEDEV_CHECKNAME;
 	args.mda_devsw = &echo_cdevsw;
@@ -420,51 +4329,233 @@ echodev_create(struct echodev_softc **scp, size_t len)
 	args.mda_gid = GID_WHEEL;
 	args.mda_mode = 0600;
 	args.mda_si_drv1 = sc;
-	error = make_dev_s(&args, &sc->dev, "echo");
+	error = make_dev_s(&args, &sc->dev, "echo%d", unit);
+	if (error == 0 && unit == 0) {
+		/* Keep the original name for the first instance. */
+		error = make_dev_alias_p(MAKEDEV_WAITOK | MAKEDEV_CHECKNAME,
+		    &sc->alias, sc->dev, "echo");
+		if (error != 0)
+			destroy_dev(sc->dev);
+	}
 	if (error != 0) {
-		free(sc->buf, M_ECHODEV);
-		knlist_destroy(&sc->rsel.si_note);
-		knlist_destroy(&sc->wsel.si_note);
-		sx_destroy(&sc->lock);
-		free(sc, M_ECHODEV);
+		echodev_free(sc);
 		return (error);
 	}
+	echodev_sysctl_init(sc);
 	*scp = sc;
 	return (0);
 }
 
+static void
+echodev_dying(struct echodev_softc *sc)
+{
+	echo_xlock(sc, LS_IOCTL);
+	sc->dying = true;
+	echo_wakeup(sc);
+	echo_xunlock(sc);
+}
+
+/*
+ * Force any sleeping threads to exit the driver and destroy the device
+ * nodes.  This also closes out any per-descriptor state, including
+ * aggregator subscriptions to other instances, so it must be done for
+ * every instance before any instance is freed.
+ */
+static void
+echodev_detach(struct echodev_softc *sc)
+{
+	echodev_dying(sc);
+	if (sc->peer != NULL)
+		echodev_dying(sc->peer);
+
+	if (sc->alias != NULL)
+		destroy_dev(sc->alias);
+	destroy_dev(sc->dev);
+}
+
 static void
 echodev_destroy(struct echodev_softc *sc)
 {
-	if (sc->dev != NULL) {
-		/* Force any sleeping threads to exit the driver. */
-		sx_xlock(&sc->lock);
-		sc->dying = true;
-		wakeup(sc);
-		sx_xunlock(&sc->lock);
+	if (sc->peer != NULL)
+		echodev_free(sc->peer);
+	echodev_free(sc);
+}
 
-		destroy_dev(sc->dev);
+/*
+ * Copy events from a CPU's trace ring.  An event is discarded if the
+ * writer may have overwritten it while it was copied.
+ */
+static int
+echo_trace_copy(struct echo_trace_ring *tr, struct echodev_trace_event *evs,
+    int max)
+{
+	u_int head;
+	int n;
+
+	n = 0;
+	while (n < max) {
+		head = atomic_load_acq_int(&tr->head);
+		if (head - tr->tail > ECHO_TRACE_ENTRIES)
+			tr->tail = head - ECHO_TRACE_ENTRIES;
+		if (tr->tail == head)
+			break;
+		evs[n] = tr->ev[tr->tail % ECHO_TRACE_ENTRIES];
+		atomic_thread_fence_acq();
+		if (atomic_load_int(&tr->head) - tr->tail < ECHO_TRACE_ENTRIES)
+			n++;
+		tr->tail++;
 	}
-	knlist_destroy(&sc->rsel.si_note);
-	knlist_destroy(&sc->wsel.si_note);
-	seldrain(&sc->rsel);
-	seldrain(&sc->wsel);
-	free(sc->buf, M_ECHODEV);
-	sx_destroy(&sc->lock);
-	free(sc, M_ECHODEV);
+	return (n);
+}
+
+static int
+echo_trace_read(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct echodev_trace_event evs[32];
+	u_int cpu;
+	int error, n;
+	bool copied;
+
+	if (uio->uio_resid < sizeof(evs[0]))
+		return (EINVAL);
+
+	sx_xlock(&echo_trace_lock);
+	error = 0;
+	for (;;) {
+		copied = false;
+		CPU_FOREACH(cpu) {
+			while (uio->uio_resid >= sizeof(evs[0])) {
+				n = echo_trace_copy(&echo_trace_rings[cpu], evs,
+				    MIN(nitems(evs),
+				    uio->uio_resid / sizeof(evs[0])));
+				if (n == 0)
+					break;
+				error = uiomove(evs, n * sizeof(evs[0]), uio);
+				if (error != 0)
+					goto out;
+				copied = true;
+			}
+		}
+		if (copied)
+			break;
+
+		/* Poll for new events. */
+		if (echo_trace_dying)
+			error = ENXIO;
+		else if (ioflag & O_NONBLOCK)
+			error = EWOULDBLOCK;
+		else {
+			error = sx_sleep(&echo_trace_rings, &echo_trace_lock,
+			    PCATCH, "echotr", hz / 10);
+			if (error == EWOULDBLOCK)
+				error = 0;
+		}
+		if (error != 0)
+			break;
+	}
+out:
+	sx_xunlock(&echo_trace_lock);
+	return (error);
+}
+
+static int
+echo_trace_init(void)
+{
+	struct make_dev_args args;
+
+	echo_trace_freq = cpu_tickrate();
+	echo_trace_rings = mallocarray(mp_maxid + 1, sizeof(*echo_trace_rings),
+	    M_ECHODEV, M_WAITOK | M_ZERO);
+	make_dev_args_init(&args);
+	args.mda_flags = MAKEDEV_WAITOK | MAKEDEV_CHECKNAME;
+	args.mda_devsw = &echo_trace_cdevsw;
+	args.mda_uid = UID_ROOT;
+	args.mda_gid = GID_WHEEL;
+	args.mda_mode = 0600;
+	return (make_dev_s(&args, &echo_trace_dev, "echotrace"));
+}
+
+static void
+echo_trace_fini(void)
+{
+	echo_tracing = false;
+	echo_trace_dying = true;
+	if (echo_trace_dev != NULL)
+		destroy_dev(echo_trace_dev);
+	free(echo_trace_rings, M_ECHODEV);
+	echo_trace_rings = NULL;
+}
+
+static void
+echodev_unload(void)
+{
+	u_int i;
+
+	if (echo_softcs == NULL)
+		return;
+
+	/* Remove all links before destroying any instances. */
+	sx_xlock(&echo_links_lock);
+	echo_links_dying = true;
+	for (i = 0; i < echo_units; i++) {
+		if (echo_softcs[i] == NULL)
+			continue;
+		echo_unlink_locked(echo_softcs[i]);
+		if (echo_softcs[i]->peer != NULL)
+			echo_unlink_locked(echo_softcs[i]->peer);
+	}
+	sx_xunlock(&echo_links_lock);
+
+	for (i = 0; i < echo_units; i++)
+		if (echo_softcs[i] != NULL)
+			echodev_detach(echo_softcs[i]);
+	for (i = 0; i < echo_units; i++)
+		if (echo_softcs[i] != NULL)
+			echodev_destroy(echo_softcs[i]);
+	free(echo_softcs, M_ECHODEV);
+	echo_softcs = NULL;
 }
 
 static int
 echodev_modevent(module_t mod, int type, void *data)
 {
-	static struct echodev_softc *echo_softc;
+	u_int i;
+	int error;
 
 	switch (type) {
 	case MOD_LOAD:
-		return (echodev_create(&echo_softc, 64));
+		error = echo_trace_init();
+		if (error != 0) {
+			echo_trace_fini();
+			return (error);
+		}
+		if (echo_units == 0 || echo_units > ECHO_UNITS_MAX)
+			echo_units = 1;
+		echo_softcs = mallocarray(echo_units, sizeof(*echo_softcs),
+		    M_ECHODEV, M_WAITOK | M_ZERO);
+		for (i = 0; i < echo_units; i++) {
+			error = echodev_create(&echo_softcs[i], i, 64);
+			if (error != 0) {
+				echodev_unload();
+				echo_trace_fini();
+				return (error);
+			}
+		}
+		return (0);
 	case MOD_UNLOAD:
-		if (echo_softc != NULL)
-			echodev_destroy(echo_softc);
+		/*
+		 * Ioctls still in progress may try to create AIO
+		 * descriptors until destroy_dev() drains them.
+		 */
+		mtx_lock(&echo_aio_mtx);
+		if (echo_aio_files != 0) {
+			mtx_unlock(&echo_aio_mtx);
+			return (EBUSY);
+		}
+		echo_aio_dying = true;
+		mtx_unlock(&echo_aio_mtx);
+		echodev_unload();
+		echo_trace_fini();
 		return (0);
 	default:
 		return (EOPNOTSUPP);
@@ -472,3 +4563,4 @@ echodev_modevent(module_t mod, int type, void *data)
 }
 
 DEV_MODULE(echodev, echodev_modevent, NULL);
+MODULE_VERSION(echodev, 1);
@@ -7,10 +7,251 @@
 #ifndef __ECHODEV_H__
 #define	__ECHODEV_H__
 
+#include <sys/types.h>
 #include <sys/ioccom.h>
 
+/*
+ * Header of a shared ring mapped at offset 0 of /dev/echo.  The ring
+ * data follows at er_offset.  er_head and er_tail are free-running
+ * byte offsets updated by a single producer and a single consumer,
+ * respectively.  A side that wishes to sleep in poll(2) or kevent(2)
+ * sets a wait flag; the other side issues ECHODEV_RING_WAKE after
+ * updating its index if the flag is set.
+ */
+struct echodev_ring {
+	uint64_t	er_head;	/* next byte to write */
+	uint64_t	er_pad0[7];
+	uint64_t	er_tail;	/* next byte to read */
+	uint64_t	er_pad1[7];
+	uint32_t	er_flags;
+	uint32_t	er_size;	/* size of ring data */
+	uint32_t	er_offset;	/* offset of ring data */
+};
+
+#define	ECHODEV_RING_RWAIT	0x1	/* consumer waiting for data */
+#define	ECHODEV_RING_WWAIT	0x2	/* producer waiting for space */
+
+#define	ECHODEV_RING_MAX	(1ul << 30)
+#define	ECHODEV_BUFSIZE_MAX	(16ul << 20)
+
+/*
+ * Block mode exchanges whole buffers mapped from /dev/echo.  Buffer
+ * N is mapped at offset N * eb_size.  A producer submits a filled
+ * buffer and obtains a free one via ECHODEV_BSWAP.  A consumer
+ * returns a consumed buffer and obtains a filled one via
+ * ECHODEV_BRELEASE.  An es_index of -1 passes no buffer in; a
+ * consumer receives -1 at EOF.  If obtaining a buffer fails, any
+ * buffer passed in has still been handed off.
+ */
+struct echodev_blocks {
+	u_int	eb_count;	/* number of buffers */
+	size_t	eb_size;	/* size of each buffer */
+};
+
+struct echodev_swap {
+	int	es_index;	/* buffer index */
+	size_t	es_len;		/* valid bytes in buffer */
+};
+
+#define	ECHODEV_BLOCKS_MAX	64
+
+/*
+ * In record mode each write(2) queues a single inline record and
+ * ECHODEV_SENDREF queues a reference to a region of a shared memory
+ * object (shm_open(2) or memfd_create(2)) in the same queue.  read(2)
+ * returns inline records and fails with EBADMSG if the next record is
+ * a reference.  ECHODEV_RECV returns either kind; references are
+ * returned as a new descriptor in er_fd.
+ */
+struct echodev_ref {
+	int	er_fd;		/* shared memory descriptor */
+	off_t	er_offset;	/* offset of region */
+	size_t	er_len;		/* length of region */
+};
+
+struct echodev_recv {
+	void	*er_buf;	/* buffer for inline data */
+	size_t	er_buflen;	/* size of er_buf */
+	size_t	er_len;		/* length of record */
+	int	er_fd;		/* descriptor for reference, or -1 */
+	off_t	er_offset;	/* offset of referenced region */
+};
+
+/*
+ * ECHODEV_SPLICE_OUT moves data from the buffer to another
+ * descriptor and ECHODEV_SPLICE_IN moves data from another descriptor
+ * into the buffer without copying it through userspace.  On return
+ * es_len holds the number of bytes moved.
+ */
+struct echodev_splice {
+	int	es_fd;		/* other descriptor */
+	size_t	es_len;		/* maximum bytes to move */
+};
+
+/*
+ * ECHODEV_LINK forwards the output of an instance to the input of
+ * another instance (/dev/echoN) in the kernel.  Several instances may
+ * feed the same destination.  A unit of -1 removes the link.
+ * ECHODEV_GLINK reports counters for an instance's link.
+ */
+struct echodev_link_stats {
+	int		el_unit;	/* destination unit, or -1 */
+	uint64_t	el_bytes;	/* bytes forwarded */
+	uint64_t	el_forwards;	/* chunks forwarded */
+	uint64_t	el_src_empty;	/* runs with no data to forward */
+	uint64_t	el_dst_full;	/* stalls on a full destination */
+};
+
+/*
+ * ECHODEV_SUBSCRIBE turns a descriptor into an aggregator that reads
+ * from a set of instances (/dev/echoN).  Each read returns one or
+ * more chunks from instances with data, each preceded by a header.
+ */
+struct echodev_agg_hdr {
+	uint32_t	eah_unit;	/* source unit */
+	uint32_t	eah_len;	/* bytes that follow */
+};
+
+/* Per-instance statistics returned by ECHODEV_GSTATS. */
+struct echodev_stats {
+	uint64_t	es_read_bytes;
+	uint64_t	es_read_calls;
+	uint64_t	es_read_wouldblock;	/* EWOULDBLOCK failures */
+	uint64_t	es_read_sleeps;		/* sleeps waiting for data */
+	uint64_t	es_write_bytes;
+	uint64_t	es_write_calls;
+	uint64_t	es_write_wouldblock;	/* EWOULDBLOCK failures */
+	uint64_t	es_write_sleeps;	/* sleeps waiting for space */
+	uint64_t	es_wakeups;		/* wakeups of sleeping threads */
+	uint64_t	es_resizes;
+	uint64_t	es_clears;
+};
+
+/*
+ * Latency histograms returned by ECHODEV_GHIST.  Buckets are
+ * log-linear with four buckets for each power of two nanoseconds.
+ * ECHODEV_HIST_MIN() gives the smallest latency counted in a bucket.
+ */
+#define	ECHODEV_HIST_READ	0	/* time in read(2) */
+#define	ECHODEV_HIST_WRITE	1	/* time in write(2) */
+#define	ECHODEV_HIST_SLEEP	2	/* time asleep for data or space */
+#define	ECHODEV_HIST_WAKEUP	3	/* wakeup until running again */
+#define	ECHODEV_HIST_COUNT	4
+
+#define	ECHODEV_HIST_BUCKETS	160
+#define	ECHODEV_HIST_MIN(b)						\
+	((b) < 4 ? (uint64_t)(b) : (uint64_t)(4 + (b) % 4) << ((b) / 4 - 1))
+
+struct echodev_hist {
+	int		eh_which;	/* ECHODEV_HIST_* */
+	uint64_t	eh_buckets[ECHODEV_HIST_BUCKETS];
+};
+
+/*
+ * Events read from /dev/echotrace.  Timestamps are in units of the
+ * hw.echo.trace_freq sysctl.  Events are ordered for each CPU but not
+ * between CPUs.
+ */
+struct echodev_trace_event {
+	uint64_t	ete_time;
+	uint64_t	ete_arg;	/* bytes, occupancy, or size */
+	uint32_t	ete_unit;
+	uint16_t	ete_cpu;
+	uint16_t	ete_type;	/* ECHODEV_TRACE_* */
+};
+
+#define	ECHODEV_TRACE_READ		1	/* bytes read */
+#define	ECHODEV_TRACE_WRITE		2	/* bytes written */
+#define	ECHODEV_TRACE_SLEEP		3	/* occupancy */
+#define	ECHODEV_TRACE_WAKEUP		4	/* occupancy */
+#define	ECHODEV_TRACE_NOTIFY_READ	5	/* occupancy */
+#define	ECHODEV_TRACE_NOTIFY_WRITE	6	/* free space */
+#define	ECHODEV_TRACE_RESIZE		7	/* new size */
+#define	ECHODEV_TRACE_CLEAR		8	/* bytes discarded */
+
+/*
+ * Buffer occupancy since the last resize, returned by
+ * ECHODEV_GOCCUPANCY.  eo_time[0] is the time spent empty and
+ * eo_time[b] is the time spent holding [2^(b-1), 2^b) bytes.
+ */
+#define	ECHODEV_OCC_BUCKETS	32
+
+struct echodev_occupancy {
+	uint64_t	eo_time[ECHODEV_OCC_BUCKETS];	/* nanoseconds */
+	uint64_t	eo_total_ns;
+	uint64_t	eo_full_ns;
+	uint64_t	eo_empty_ns;
+	uint64_t	eo_hwm;		/* high-water mark in bytes */
+	uint64_t	eo_age_ns;	/* age of the oldest unread byte */
+	uint64_t	eo_max_age_ns;	/* largest age of an unread byte */
+	uint64_t	eo_size;	/* current buffer size */
+};
+
+/*
+ * Read-only status page mapped at ECHODEV_STATUS_OFFSET from a
+ * descriptor opened read-only.  es_seq is odd while the driver is
+ * updating the page; readers should copy the page and retry if es_seq
+ * was odd or changed during the copy.  Buffer state is updated as it
+ * changes, while es_stats is refreshed every hw.echo.status_interval
+ * milliseconds while the page is mapped.
+ */
+#define	ECHODEV_STATUS_OFFSET	((off_t)1 << 40)
+
+struct echodev_status {
+	volatile uint32_t es_seq;
+	uint32_t	es_writers;	/* open writers */
+	uint64_t	es_valid;	/* bytes available to read */
+	uint64_t	es_space;	/* bytes available to write */
+	uint64_t	es_len;		/* buffer size */
+	uint64_t	es_stats_time;	/* uptime of es_stats in ns */
+	struct echodev_stats es_stats;
+};
+
+/*
+ * ECHODEV_PAIR turns a descriptor into endpoint 0 or 1 of a
+ * bidirectional pair.  Data written on one endpoint is read on the
+ * other.  Each direction has its own buffer and wakeups.  A unit has
+ * a single peer direction, so only one pair per unit should be open
+ * at a time; an endpoint 0 sees EOF once every endpoint 1 has closed.
+ * On an endpoint, ECHODEV_BRELEASE, ECHODEV_RECV, ECHODEV_SPLICE_OUT,
+ * ECHODEV_LINK and requests for statistics act on the direction it
+ * reads, and other requests on the direction it writes.  Ring and
+ * block modes cannot be used through an endpoint.
+ *
+ * Loan mode only passes page-aligned writes to a waiting reader in
+ * larger chunks than a direct write; the pages are still copied and
+ * never remapped copy-on-write.  "echoctl loanbench" measures that.
+ *
+ * ECHODEV_SBUFSIZE accepts sizes up to ECHODEV_BUFSIZE_MAX.  Shrinking
+ * below the buffered data waits for readers to drain it; with
+ * O_NONBLOCK it fails with EWOULDBLOCK instead and must be retried.
+ */
 #define	ECHODEV_GBUFSIZE	_IOR('E', 100, size_t)	/* get buffer size */
 #define	ECHODEV_SBUFSIZE	_IOW('E', 101, size_t)	/* set buffer size */
 #define	ECHODEV_CLEAR		_IO('E', 102)		/* clear buffer */
+#define	ECHODEV_GRING		_IOR('E', 103, size_t)	/* get ring size */
+#define	ECHODEV_SRING		_IOW('E', 104, size_t)	/* set ring size */
+#define	ECHODEV_RING_WAKE	_IO('E', 105)		/* wake ring waiters */
+#define	ECHODEV_GBLOCKS		_IOR('E', 106, struct echodev_blocks)
+#define	ECHODEV_SBLOCKS		_IOW('E', 107, struct echodev_blocks)
+#define	ECHODEV_BSWAP		_IOWR('E', 108, struct echodev_swap)
+#define	ECHODEV_BRELEASE	_IOWR('E', 109, struct echodev_swap)
+#define	ECHODEV_GLOAN		_IOR('E', 110, int)	/* get loan mode */
+#define	ECHODEV_SLOAN		_IOW('E', 111, int)	/* set loan mode */
+#define	ECHODEV_GRECORDS	_IOR('E', 112, int)	/* get record mode */
+#define	ECHODEV_SRECORDS	_IOW('E', 113, int)	/* set record mode */
+#define	ECHODEV_SENDREF		_IOW('E', 114, struct echodev_ref)
+#define	ECHODEV_RECV		_IOWR('E', 115, struct echodev_recv)
+#define	ECHODEV_SPLICE_OUT	_IOWR('E', 116, struct echodev_splice)
+#define	ECHODEV_SPLICE_IN	_IOWR('E', 117, struct echodev_splice)
+#define	ECHODEV_LINK		_IOW('E', 118, int)	/* forward to unit */
+#define	ECHODEV_GLINK		_IOR('E', 119, struct echodev_link_stats)
+#define	ECHODEV_PAIR		_IOW('E', 120, int)	/* join a pair */
+#define	ECHODEV_SUBSCRIBE	_IOW('E', 121, int)	/* aggregate unit */
+#define	ECHODEV_UNSUBSCRIBE	_IOW('E', 122, int)	/* stop aggregating */
+#define	ECHODEV_AIOFD		_IOR('E', 123, int)	/* new AIO fd */
+#define	ECHODEV_GSTATS		_IOR('E', 124, struct echodev_stats)
+#define	ECHODEV_GHIST		_IOWR('E', 125, struct echodev_hist)
+#define	ECHODEV_GOCCUPANCY	_IOR('E', 126, struct echodev_occupancy)
 
 #endif /* !__ECHODEV_H__ */
@@ -0,0 +1,39 @@
+/*-
+ * Copyright (c) 2024 John Baldwin <jhb@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __ECHODEV_KPI_H__
+#define	__ECHODEV_KPI_H__
+
+/*
+ * Interface for other kernel modules to move data through an echo
+ * instance.  Modules using this should declare
+ * MODULE_DEPEND(..., echodev, 1, 1, 1).
+ *
+ * echodev_enqueue() and echodev_dequeue() behave like write(2) and
+ * read(2) on /dev/echo<unit> and may sleep unless ECHODEV_NOWAIT is
+ * set.  Even with ECHODEV_NOWAIT they acquire sleepable locks.
+ *
+ * A producer should call echodev_producer_register() before its first
+ * enqueue and echodev_producer_deregister() after its last.  While
+ * registered it counts as a writer, so readers do not see EOF.
+ *
+ * echodev_enqueue_nosleep() may be called while holding non-sleepable
+ * locks such as from an interrupt thread or callout.  The data is
+ * staged and moved into the instance from a task.  It fails with
+ * ENOBUFS if too much data is already staged.
+ */
+
+#define	ECHODEV_NOWAIT	0x1	/* fail with EWOULDBLOCK instead of sleeping */
+
+int	echodev_enqueue(int unit, const void *buf, size_t len, int flags,
+	    size_t *donep);
+int	echodev_enqueue_nosleep(int unit, const void *buf, size_t len);
+int	echodev_dequeue(int unit, void *buf, size_t len, int flags,
+	    size_t *donep);
+int	echodev_producer_register(int unit);
+void	echodev_producer_deregister(int unit);
+
+#endif /* !__ECHODEV_KPI_H__ */
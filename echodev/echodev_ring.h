@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2024 John Baldwin <jhb@FreeBSD.org>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef __ECHODEV_RING_H__
+#define	__ECHODEV_RING_H__
+
+/*
+ * Userspace helpers for a shared ring exported by /dev/echo.  Each
+ * ring supports a single producer and a single consumer.  Both must
+ * open the device for reading and writing.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <machine/atomic.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "echodev.h"
+
+struct echodev_ring_handle {
+	int	fd;
+	struct echodev_ring *hdr;
+	char	*data;
+	size_t	size;
+	size_t	mapsize;
+};
+
+static __inline int
+echodev_ring_attach(struct echodev_ring_handle *h, int fd)
+{
+	void *p;
+	size_t size;
+
+	if (ioctl(fd, ECHODEV_GRING, &size) == -1)
+		return (-1);
+	if (size == 0)
+		return (-1);
+	h->mapsize = getpagesize() + size;
+	p = mmap(NULL, h->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return (-1);
+	h->fd = fd;
+	h->hdr = p;
+	h->data = (char *)p + h->hdr->er_offset;
+	h->size = size;
+	return (0);
+}
+
+static __inline void
+echodev_ring_detach(struct echodev_ring_handle *h)
+{
+	munmap(h->hdr, h->mapsize);
+	h->hdr = NULL;
+}
+
+static __inline void
+echodev_ring_notify(struct echodev_ring_handle *h, uint32_t flag)
+{
+	atomic_thread_fence_seq_cst();
+	if ((atomic_load_acq_32(&h->hdr->er_flags) & flag) != 0)
+		(void)ioctl(h->fd, ECHODEV_RING_WAKE);
+}
+
+/*
+ * Producer: returns the number of contiguous bytes available to
+ * write at *pp.
+ */
+static __inline size_t
+echodev_ring_reserve(struct echodev_ring_handle *h, void **pp)
+{
+	uint64_t head, tail;
+	size_t off, space;
+
+	head = h->hdr->er_head;
+	tail = atomic_load_acq_64(&h->hdr->er_tail);
+	space = h->size - (head - tail);
+	off = head & (h->size - 1);
+	*pp = h->data + off;
+	return (space < h->size - off ? space : h->size - off);
+}
+
+/* Producer: publish len bytes previously reserved. */
+static __inline void
+echodev_ring_commit(struct echodev_ring_handle *h, size_t len)
+{
+	atomic_store_rel_64(&h->hdr->er_head, h->hdr->er_head + len);
+	echodev_ring_notify(h, ECHODEV_RING_RWAIT);
+}
+
+/*
+ * Consumer: returns the number of contiguous bytes available to read
+ * at *pp.
+ */
+static __inline size_t
+echodev_ring_peek(struct echodev_ring_handle *h, const void **pp)
+{
+	uint64_t head, tail;
+	size_t avail, off;
+
+	tail = h->hdr->er_tail;
+	head = atomic_load_acq_64(&h->hdr->er_head);
+	avail = head - tail;
+	off = tail & (h->size - 1);
+	*pp = h->data + off;
+	return (avail < h->size - off ? avail : h->size - off);
+}
+
+/* Consumer: release len bytes previously peeked. */
+static __inline void
+echodev_ring_release(struct echodev_ring_handle *h, size_t len)
+{
+	atomic_store_rel_64(&h->hdr->er_tail, h->hdr->er_tail + len);
+	echodev_ring_notify(h, ECHODEV_RING_WWAIT);
+}
+
+/*
+ * Sleep until the ring is readable (POLLIN) or writable (POLLOUT).
+ * The driver requests a wakeup from the other side before sleeping.
+ */
+static __inline int
+echodev_ring_wait(struct echodev_ring_handle *h, int events, int timeout)
+{
+	struct pollfd pfd;
+
+	pfd.fd = h->fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, timeout));
+}
+
+#endif /* !__ECHODEV_RING_H__ */